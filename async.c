@@ -0,0 +1,325 @@
+/* libcda; asynchronous commands for the Linux component.
+ *
+ * Each drive gets a worker thread the first time something is submitted
+ * to it.  Requests are queued and run in order; completion can be
+ * polled, waited for, or noticed through an eventfd.  Submitting never
+ * takes the command lock, so it doesn't wait for a command in flight.
+ *
+ * io_uring would avoid the thread, but it cannot carry the cdrom ioctls
+ * or SG_IO to sr devices, so there is nothing to submit to it.
+ */
+
+#include <string.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/eventfd.h>
+#include "cdaint.h"
+
+
+struct cd_request {
+    int op;
+    int arg0, arg1;
+    void *buf;
+
+    int done;
+    int result;
+    int error_code;
+    char error[256];
+
+    cd_request *next;
+};
+
+
+struct Async {
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    cd_request *head, *tail;
+    int quit;
+    int efd;
+};
+
+
+static void run_request(cd_device *dev, cd_request *req)
+{
+    int ret = 0;
+
+    cd_errno = CDERR_NONE;
+
+    switch (req->op) {
+	case CD_OP_READ_AUDIO:
+	    ret = cd_read_audio(dev, req->arg0, req->arg1, req->buf);
+	    break;
+	case CD_OP_PLAY:
+	    ret = cd_play_range_h(dev, req->arg0, req->arg1);
+	    break;
+	case CD_OP_PAUSE:
+	    cd_pause_h(dev);
+	    break;
+	case CD_OP_RESUME:
+	    cd_resume_h(dev);
+	    break;
+	case CD_OP_STOP:
+	    cd_stop_h(dev);
+	    break;
+	case CD_OP_EJECT:
+	    cd_eject_h(dev);
+	    break;
+	case CD_OP_CLOSE:
+	    cd_close_h(dev);
+	    break;
+	case CD_OP_READ_TOC:
+	    ret = cd_get_tracks_h(dev, NULL, NULL);
+	    break;
+	default:
+	    _cd_set_error(CDERR_BAD_ARG, "Unknown request");
+	    ret = -1;
+	    break;
+    }
+
+    req->result = ret;
+    if (ret != 0) {
+	req->error_code = cd_errno;
+	strncpy(req->error, cd_error, sizeof req->error);
+	req->error[sizeof req->error - 1] = 0;
+    }
+}
+
+
+static void *worker(void *arg)
+{
+    cd_device *dev = arg;
+    struct Async *as;
+    cd_request *req;
+    uint64_t one = 1;
+
+    /* Wait for start_async to publish it. */
+    pthread_mutex_lock(&dev->async_lock);
+    as = dev->async;
+    pthread_mutex_unlock(&dev->async_lock);
+
+    pthread_mutex_lock(&as->lock);
+
+    for (;;) {
+	while (!as->head && !as->quit)
+	    pthread_cond_wait(&as->cond, &as->lock);
+
+	req = as->head;
+	if (!req)
+	    break;
+
+	as->head = req->next;
+	if (!as->head)
+	    as->tail = NULL;
+
+	pthread_mutex_unlock(&as->lock);
+	run_request(dev, req);
+	pthread_mutex_lock(&as->lock);
+
+	__atomic_store_n(&req->done, 1, __ATOMIC_RELEASE);
+	pthread_cond_broadcast(&as->cond);
+	if (write(as->efd, &one, sizeof one) < 0) {
+	    /* the counter is saturated; readers will notice anyway */
+	}
+    }
+
+    pthread_mutex_unlock(&as->lock);
+    return NULL;
+}
+
+
+/* start_async:
+ *  Return the worker for DEV, creating it if it doesn't have one yet,
+ *  or NULL on error.
+ */
+static struct Async *start_async(cd_device *dev)
+{
+    struct Async *as = __atomic_load_n(&dev->async, __ATOMIC_ACQUIRE);
+
+    if (as)
+	return as;
+
+    pthread_mutex_lock(&dev->async_lock);
+
+    as = dev->async;
+    if (as)
+	goto done;
+
+    as = calloc(1, sizeof(struct Async));
+    if (!as) {
+	_cd_copy_error();
+	goto done;
+    }
+
+    as->efd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (as->efd < 0) {
+	_cd_copy_error();
+	free(as);
+	as = NULL;
+	goto done;
+    }
+
+    pthread_mutex_init(&as->lock, NULL);
+    pthread_cond_init(&as->cond, NULL);
+
+    if (pthread_create(&as->thread, NULL, worker, dev) != 0) {
+	_cd_set_error(CDERR_NO_MEMORY, "Cannot create thread");
+	pthread_cond_destroy(&as->cond);
+	pthread_mutex_destroy(&as->lock);
+	close(as->efd);
+	free(as);
+	as = NULL;
+	goto done;
+    }
+
+    __atomic_store_n(&dev->async, as, __ATOMIC_RELEASE);
+
+  done:
+    pthread_mutex_unlock(&dev->async_lock);
+    return as;
+}
+
+
+/* _cd_async_shutdown:
+ *  Finish the queued requests for DEV and stop its worker.
+ */
+void _cd_async_shutdown(cd_device *dev)
+{
+    struct Async *as = dev->async;
+
+    if (!as)
+	return;
+
+    pthread_mutex_lock(&as->lock);
+    as->quit = 1;
+    pthread_cond_broadcast(&as->cond);
+    pthread_mutex_unlock(&as->lock);
+
+    pthread_join(as->thread, NULL);
+    pthread_cond_destroy(&as->cond);
+    pthread_mutex_destroy(&as->lock);
+    close(as->efd);
+    free(as);
+    dev->async = NULL;
+}
+
+
+/* _cd_async_signal:
+ *  Make the file descriptor of DEV readable, as if a request had
+ *  completed.
+ */
+void _cd_async_signal(cd_device *dev)
+{
+    struct Async *as = start_async(dev);
+    uint64_t one = 1;
+
+    if (!as)
+	return;
+
+    if (write(as->efd, &one, sizeof one) < 0) {
+	/* the counter is saturated; readers will notice anyway */
+    }
+}
+
+
+/* cd_submit:
+ *  Queue command OP for DEV and return a request token for it without
+ *  waiting, or NULL on error.  ARG0, ARG1 and BUF are the arguments of
+ *  the synchronous function OP stands for.
+ */
+cd_request *cd_submit(cd_device *dev, int op, int arg0, int arg1, void *buf)
+{
+    cd_request *req;
+    struct Async *as;
+
+    as = start_async(dev);
+    if (!as)
+	return NULL;
+
+    req = calloc(1, sizeof(cd_request));
+    if (!req) {
+	_cd_copy_error();
+	return NULL;
+    }
+
+    req->op = op;
+    req->arg0 = arg0;
+    req->arg1 = arg1;
+    req->buf = buf;
+
+    pthread_mutex_lock(&as->lock);
+    if (as->tail)
+	as->tail->next = req;
+    else
+	as->head = req;
+    as->tail = req;
+    pthread_cond_broadcast(&as->cond);
+    pthread_mutex_unlock(&as->lock);
+
+    return req;
+}
+
+
+/* cd_submit_read:
+ *  Shorthand for an asynchronous cd_read_audio.
+ */
+cd_request *cd_submit_read(cd_device *dev, int lba, int nframes, void *buf)
+{
+    return cd_submit(dev, CD_OP_READ_AUDIO, lba, nframes, buf);
+}
+
+
+/* cd_request_done:
+ *  Return non-zero if REQ has completed.  Never blocks.
+ */
+int cd_request_done(cd_request *req)
+{
+    return __atomic_load_n(&req->done, __ATOMIC_ACQUIRE);
+}
+
+
+/* cd_request_wait:
+ *  Wait for REQ on DEV to complete and return its result, like the
+ *  synchronous function would.  On error, cd_error is set from the
+ *  request.
+ */
+int cd_request_wait(cd_device *dev, cd_request *req)
+{
+    struct Async *as = dev->async;
+
+    if (!cd_request_done(req)) {
+	pthread_mutex_lock(&as->lock);
+	while (!req->done)
+	    pthread_cond_wait(&as->cond, &as->lock);
+	pthread_mutex_unlock(&as->lock);
+    }
+
+    if (req->result != 0)
+	_cd_set_error(req->error_code, req->error);
+
+    return req->result;
+}
+
+
+/* cd_request_free:
+ *  Free a completed request.
+ */
+void cd_request_free(cd_request *req)
+{
+    free(req);
+}
+
+
+/* cd_async_fd:
+ *  Return a file descriptor which becomes readable whenever a request
+ *  on DEV completes, for use with poll or select.  Read 8 bytes from it
+ *  to reset it.  Return -1 on error.
+ */
+int cd_async_fd(cd_device *dev)
+{
+    struct Async *as = start_async(dev);
+
+    return (as) ? as->efd : -1;
+}
@@ -0,0 +1,311 @@
+/*
+ * Benchmark for libcda (Linux).
+ *
+ * Calls each function many times on one drive, disc image or emulated
+ * drive, and extracts some audio, then prints what it cost as JSON:
+ * latency percentiles per function, how many ioctls each call made,
+ * and extraction throughput.
+ *
+ *	bench [-n calls] [-f frames] [-e] [path]
+ *
+ * PATH is anything cd_open accepts, e.g. /dev/sr0, disc.cue or
+ * "emu:speed=8".  -e also times eject and close, which is noisy.
+ *
+ * ioctls are counted by defining ioctl here, in front of the C
+ * library's, so nothing in libcda has to know about it.
+ */
+
+#define _GNU_SOURCE
+#include <dlfcn.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <time.h>
+#include <unistd.h>
+#include "libcda.h"
+
+
+static unsigned long ioctls;
+
+static int ncalls = 200;
+static int nframes = 75 * 60;
+static int with_eject = 0;
+
+static cd_device *dev;
+static int first, last, audio_track;
+static int got;
+static int call_number;		/* of the current function */
+static double elapsed;
+static double *times;
+
+
+int ioctl(int fd, unsigned long request, ...)
+{
+    static int (*real_ioctl)(int, unsigned long, ...);
+    va_list ap;
+    void *arg;
+
+    if (!real_ioctl)
+	real_ioctl = dlsym(RTLD_NEXT, "ioctl");
+
+    va_start(ap, request);
+    arg = va_arg(ap, void *);
+    va_end(ap);
+
+    __atomic_add_fetch(&ioctls, 1, __ATOMIC_RELAXED);
+    return real_ioctl(fd, request, arg);
+}
+
+
+static double get_secs(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+
+static int cmp_double(const void *a, const void *b)
+{
+    double x = *(const double *)a, y = *(const double *)b;
+
+    return (x > y) - (x < y);
+}
+
+
+static int separator;
+
+
+/* print_string:
+ *  Print S as a JSON string.
+ */
+static void print_string(const char *s)
+{
+    putchar('"');
+    for (; *s; s++) {
+	if ((*s == '"') || (*s == '\\'))
+	    printf("\\%c", *s);
+	else if ((unsigned char)*s < 0x20)
+	    printf("\\u%04x", (unsigned char)*s);
+	else
+	    putchar(*s);
+    }
+    putchar('"');
+}
+
+
+/* report:
+ *  Print the JSON for N calls of NAME, whose times are in TIMES.
+ */
+static void report(const char *name, int n, int errors, unsigned long nioctls)
+{
+    qsort(times, n, sizeof(double), cmp_double);
+
+    printf("%s\n    \"%s\": { \"calls\": %d, \"errors\": %d, "
+	   "\"p50_us\": %.1f, \"p99_us\": %.1f, \"max_us\": %.1f, "
+	   "\"ioctls_per_call\": %.2f }",
+	   separator ? "," : "", name, n, errors,
+	   times[n / 2] * 1e6, times[(n * 99) / 100] * 1e6, times[n - 1] * 1e6,
+	   (double)nioctls / n);
+    separator = 1;
+}
+
+
+/* Each of these makes one call; a non-zero return is an error. */
+
+static int do_get_tracks(void)	  { return cd_get_tracks_h(dev, NULL, NULL); }
+static int do_is_audio(void)	  { return cd_is_audio_h(dev, first) < 0; }
+static int do_current_track(void) { cd_current_track_h(dev); return 0; }
+static int do_is_paused(void)	  { cd_is_paused_h(dev); return 0; }
+static int do_get_volume(void)	  { cd_get_volume_h(dev, NULL, NULL); return 0; }
+static int do_set_volume(void)	  { cd_set_volume_h(dev, 255, 255); return 0; }
+static int do_play(void)	  { return cd_play_h(dev, audio_track); }
+static int do_pause(void)	  { cd_pause_h(dev); return 0; }
+static int do_resume(void)	  { cd_resume_h(dev); return 0; }
+static int do_stop(void)	  { cd_stop_h(dev); return 0; }
+static int do_eject(void)	  { cd_eject_h(dev); return 0; }
+static int do_close(void)	  { cd_close_h(dev); return 0; }
+
+/* Single frames, one after another from the start of the disc. */
+static int do_read_frame(void)
+{
+    static unsigned char buf[CD_FRAME_BYTES];
+
+    return cd_read_audio(dev, call_number, 1, buf);
+}
+
+
+static struct {
+    const char *name;
+    int (*fn)(void);
+    int eject;
+} calls[] = {
+    { "cd_get_tracks",	  do_get_tracks,    0 },
+    { "cd_is_audio",	  do_is_audio,	    0 },
+    { "cd_current_track", do_current_track, 0 },
+    { "cd_is_paused",	  do_is_paused,	    0 },
+    { "cd_get_volume",	  do_get_volume,    0 },
+    { "cd_set_volume",	  do_set_volume,    0 },
+    { "cd_play",	  do_play,	    0 },
+    { "cd_pause",	  do_pause,	    0 },
+    { "cd_resume",	  do_resume,	    0 },
+    { "cd_stop",	  do_stop,	    0 },
+    { "cd_read_audio",	  do_read_frame,    0 },
+    { "cd_eject",	  do_eject,	    1 },
+    { "cd_close",	  do_close,	    1 },
+    { NULL, NULL, 0 }
+};
+
+
+static void bench_calls(void)
+{
+    unsigned long before;
+    double t;
+    int i, j, errors;
+
+    for (i = 0; calls[i].name; i++) {
+	if (calls[i].eject && !with_eject)
+	    continue;
+
+	errors = 0;
+	before = __atomic_load_n(&ioctls, __ATOMIC_RELAXED);
+
+	for (j = 0; j < ncalls; j++) {
+	    call_number = j;
+	    t = get_secs();
+	    if (calls[i].fn() != 0)
+		errors++;
+	    times[j] = get_secs() - t;
+	}
+
+	report(calls[i].name, ncalls, errors,
+	       __atomic_load_n(&ioctls, __ATOMIC_RELAXED) - before);
+    }
+}
+
+
+/* bench_extract:
+ *  Stream up to NFRAMES frames from the first audio track, timing each
+ *  read.  Return zero on success.
+ */
+static int bench_extract(void)
+{
+    const int chunk = 75;
+    unsigned char *buf;
+    unsigned long before;
+    cd_stream *s;
+    double t, start;
+    int n, i = 0, errors = 0;
+
+    s = cd_stream_open(dev, audio_track, audio_track);
+    buf = malloc(chunk * CD_FRAME_BYTES);
+    free(times);
+    times = malloc((nframes / chunk + 1) * sizeof(double));
+    if (!s || !buf || !times) {
+	fprintf(stderr, "bench: cannot open stream (%s)\n", cd_error);
+	if (s)
+	    cd_stream_close(s);
+	free(buf);
+	return -1;
+    }
+
+    before = __atomic_load_n(&ioctls, __ATOMIC_RELAXED);
+    start = get_secs();
+
+    while (got < nframes) {
+	t = get_secs();
+	n = cd_stream_read(s, buf, (nframes - got < chunk) ? nframes - got : chunk);
+	times[i++] = get_secs() - t;
+	if (n < 0)
+	    errors++;
+	if (n <= 0)
+	    break;
+	got += n;
+    }
+
+    elapsed = get_secs() - start;
+
+    report("cd_stream_read", i, errors,
+	   __atomic_load_n(&ioctls, __ATOMIC_RELAXED) - before);
+
+    cd_stream_close(s);
+    free(buf);
+    return 0;
+}
+
+
+int main(int argc, char *argv[])
+{
+    const char *path = NULL;
+    int c, ret;
+
+    while ((c = getopt(argc, argv, "n:f:e")) != -1) {
+	switch (c) {
+	    case 'n': ncalls = atoi(optarg); break;
+	    case 'f': nframes = atoi(optarg); break;
+	    case 'e': with_eject = 1; break;
+	    default:
+		fprintf(stderr, "usage: bench [-n calls] [-f frames] [-e] [path]\n");
+		return 1;
+	}
+    }
+
+    if ((ncalls < 1) || (nframes < 1)) {
+	fprintf(stderr, "bench: calls and frames must be positive\n");
+	return 1;
+    }
+
+    if (optind < argc)
+	path = argv[optind];
+    if (!path) path = getenv("CDAUDIO");
+    if (!path) path = "/dev/cdrom";
+
+    dev = cd_open(path);
+    if (!dev) {
+	fprintf(stderr, "bench: cannot open drive (%s)\n", cd_error);
+	return 1;
+    }
+
+    if (cd_get_tracks_h(dev, &first, &last) != 0) {
+	fprintf(stderr, "bench: cannot read TOC (%s)\n", cd_error);
+	cd_release(dev);
+	return 1;
+    }
+
+    for (audio_track = first; audio_track <= last; audio_track++)
+	if (cd_is_audio_h(dev, audio_track) == 1)
+	    break;
+    if (audio_track > last) {
+	fprintf(stderr, "bench: no audio tracks\n");
+	cd_release(dev);
+	return 1;
+    }
+
+    times = malloc(ncalls * sizeof(double));
+    if (!times)
+	return 1;
+
+    printf("{\n  \"path\": ");
+    print_string(path);
+    printf(",\n  \"calls\": {");
+    bench_calls();
+    cd_stop_h(dev);
+    ret = bench_extract();
+    printf("\n  }");
+
+    if (ret == 0)
+	printf(",\n  \"extract\": { \"frames\": %d, \"seconds\": %.3f, "
+	       "\"mb_per_s\": %.2f, \"speed_x\": %.2f, \"read_batch\": %d }",
+	       got, elapsed,
+	       (elapsed > 0) ? got * (double)CD_FRAME_BYTES / elapsed / 1e6 : 0,
+	       (elapsed > 0) ? got / 75.0 / elapsed : 0,
+	       cd_get_read_batch(dev));
+
+    printf("\n}\n");
+
+    cd_release(dev);
+    free(times);
+    return 0;
+}
@@ -0,0 +1,506 @@
+/* libcda; TOC cache for the Linux component.
+ *
+ * Discs seen before are remembered in a file: the TOC, and the
+ * checksums of tracks read in full.  Next time, the drive is only asked
+ * for the first and last track and the leadout, and if those match a
+ * disc in the file the rest comes from there.  Disc IDs are worked out
+ * from the TOC (see discid.c), so they come for free.
+ *
+ * Only the ioctl driver can read just those (READ_TOC_HEADER), and
+ * only it needs to, as it asks for the TOC a track at a time.  SG_IO
+ * gets the whole TOC in one command, and images and emulated drives
+ * have it in memory, so they read it all and compare it as below.
+ *
+ * Two discs can have the same track count and leadout.  So a TOC, and
+ * checksums, brought back for a disc matched that way are marked
+ * unverified; only if the whole TOC was read and matched are they as
+ * good as new.
+ *
+ * The file is a list of records which is only ever appended to, by
+ * single writes, so several processes can share it.  It is mapped into
+ * memory, and each record is put in a hash table on the disc it is for
+ * as it is first seen, so looking a disc up doesn't mean reading the
+ * file; a later record for a disc overrides an earlier one.  Readers
+ * stop at a record cut short, which may be a write in progress.
+ * Writers hold an exclusive flock, and cut off a record which a crash
+ * left short before adding theirs, so one can only be at the end.
+ * Records are in the machine's own byte order.
+ */
+
+#include <string.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "cdaint.h"
+
+
+#define RECORD_MAGIC	0x31414443	/* "CDA1" */
+#define RECORD_TOC	1
+#define RECORD_SUMS	2
+
+#define MIN_SLOTS	64
+
+
+/* Every record starts with this.  FIRST, LAST and LEADOUT identify the
+ * disc.
+ */
+typedef struct {
+    uint32_t magic;
+    uint16_t type;
+    uint16_t size;		/* of the whole record */
+    int32_t first, last, leadout;
+} Record;
+
+
+/* A TOC record is followed by the ctrl and LBA of each track. */
+typedef struct {
+    int32_t ctrl, lba;
+} RecordTrack;
+
+
+typedef struct {
+    Record r;
+    int32_t track;
+    uint32_t crc, ar_lo, ar_hi;
+} SumsRecord;
+
+
+/* What the file holds for one disc: where its latest records are, or
+ * -1.
+ */
+typedef struct {
+    int first, last, leadout;
+    long toc;
+    long sums[CD_MAX_TRACKS + 1];
+} Entry;
+
+
+struct Cache {
+    int fd;
+    const unsigned char *map;
+    size_t size;		/* of MAP */
+    size_t indexed;		/* records before this are in the table */
+
+    Entry **slots;		/* open addressing on the disc */
+    int nslots, nentries;
+};
+
+
+/* remap:
+ *  Map all of the file, which may have grown since last time.
+ */
+static void remap(struct Cache *c)
+{
+    struct stat st;
+    size_t size;
+    void *p;
+
+    if (fstat(c->fd, &st) != 0)
+	return;
+    size = st.st_size;
+    if (size == c->size)
+	return;
+
+    if (c->map)
+	munmap((void *)c->map, c->size);
+    c->map = NULL;
+    c->size = 0;
+
+    if (size > 0) {
+	p = mmap(NULL, size, PROT_READ, MAP_SHARED, c->fd, 0);
+	if (p != MAP_FAILED) {
+	    c->map = p;
+	    c->size = size;
+	}
+    }
+
+    /* Only a writer cutting off a torn record shrinks the file. */
+    c->indexed = MIN(c->indexed, c->size);
+}
+
+
+static unsigned int hash(int first, int last, int leadout)
+{
+    return ((unsigned int)leadout * 2654435761u) ^ (first << 8) ^ last;
+}
+
+
+/* lookup:
+ *  Return the slot for the disc FIRST, LAST, LEADOUT: the one it is in,
+ *  or the empty one it would go in.
+ */
+static Entry **lookup(struct Cache *c, int first, int last, int leadout)
+{
+    unsigned int i = hash(first, last, leadout) & (c->nslots - 1);
+    Entry *e;
+
+    while ((e = c->slots[i]) != NULL) {
+	if ((e->first == first) && (e->last == last) && (e->leadout == leadout))
+	    break;
+	i = (i + 1) & (c->nslots - 1);
+    }
+
+    return &c->slots[i];
+}
+
+
+/* grow:
+ *  Double the size of the table.  Return zero on success.
+ */
+static int grow(struct Cache *c)
+{
+    Entry **old = c->slots;
+    int n = c->nslots, i;
+
+    c->slots = calloc(n * 2, sizeof(Entry *));
+    if (!c->slots) {
+	c->slots = old;
+	return -1;
+    }
+    c->nslots = n * 2;
+
+    for (i = 0; i < n; i++)
+	if (old[i])
+	    *lookup(c, old[i]->first, old[i]->last, old[i]->leadout) = old[i];
+
+    free(old);
+    return 0;
+}
+
+
+/* add_record:
+ *  Put the record R at POS in the table.
+ */
+static void add_record(struct Cache *c, const Record *r, long pos)
+{
+    const SumsRecord *s;
+    Entry **slot, *e;
+    int t;
+
+    if ((r->first < 1) || (r->last > CD_MAX_TRACKS) || (r->first > r->last))
+	return;
+
+    slot = lookup(c, r->first, r->last, r->leadout);
+    e = *slot;
+
+    if (!e) {
+	if ((c->nentries + 1) * 2 > c->nslots) {
+	    if (grow(c) != 0)
+		return;
+	    slot = lookup(c, r->first, r->last, r->leadout);
+	}
+
+	e = malloc(sizeof(Entry));
+	if (!e)
+	    return;
+	e->first = r->first;
+	e->last = r->last;
+	e->leadout = r->leadout;
+	e->toc = -1;
+	for (t = 0; t <= CD_MAX_TRACKS; t++)
+	    e->sums[t] = -1;
+
+	*slot = e;
+	c->nentries++;
+    }
+
+    if ((r->type == RECORD_TOC) &&
+	(r->size == sizeof(Record) + (r->last - r->first + 1) * sizeof(RecordTrack)))
+	e->toc = pos;
+    else if ((r->type == RECORD_SUMS) && (r->size == sizeof(SumsRecord))) {
+	s = (const SumsRecord *)r;
+	if ((s->track >= r->first) && (s->track <= r->last))
+	    e->sums[s->track] = pos;
+    }
+}
+
+
+/* update:
+ *  Put any records added to the file since last time in the table.
+ *  Return non-zero if the file ends with a record cut short.
+ */
+static int update(struct Cache *c)
+{
+    const Record *r;
+    size_t pos;
+
+    remap(c);
+
+    for (pos = c->indexed; pos + sizeof(Record) <= c->size; pos += r->size) {
+	r = (const Record *)(c->map + pos);
+	if ((r->magic != RECORD_MAGIC) || (r->size < sizeof(Record)) ||
+	    (r->size % 4) || (pos + r->size > c->size))
+	    break;
+	add_record(c, r, pos);
+    }
+
+    c->indexed = pos;
+    return pos < c->size;
+}
+
+
+/* find:
+ *  Return what the file holds for the disc FIRST, LAST, LEADOUT, or
+ *  NULL.
+ */
+static const Entry *find(struct Cache *c, int first, int last, int leadout)
+{
+    update(c);
+    return *lookup(c, first, last, leadout);
+}
+
+
+/* get_toc, get_sums:
+ *  Return the latest record of the kind for E, or NULL.  Records are
+ *  checked against the map in case it couldn't be remapped.
+ */
+static const RecordTrack *get_toc(struct Cache *c, const Entry *e)
+{
+    if ((e->toc < 0) || ((size_t)e->toc + sizeof(Record) > c->size))
+	return NULL;
+
+    return (const RecordTrack *)(c->map + e->toc + sizeof(Record));
+}
+
+
+static const SumsRecord *get_sums(struct Cache *c, const Entry *e, int t)
+{
+    if ((e->sums[t] < 0) || ((size_t)e->sums[t] + sizeof(SumsRecord) > c->size))
+	return NULL;
+
+    return (const SumsRecord *)(c->map + e->sums[t]);
+}
+
+
+/* append:
+ *  Add a record to the file, first cutting off one left short.
+ */
+static void append(struct Cache *c, const void *r, int size)
+{
+    /* The cache is only a cache: if it can't be written, never mind. */
+    if (flock(c->fd, LOCK_EX) != 0)
+	return;
+
+    /* Every writer holds the lock, so this isn't one being written. */
+    if ((update(c)) && (ftruncate(c->fd, c->indexed) == 0))
+	remap(c);
+
+    if (write(c->fd, r, size) != size) {
+	/* the next writer will cut it off */
+    }
+
+    flock(c->fd, LOCK_UN);
+}
+
+
+static void fill_record(cd_device *dev, Record *r, int type, int size)
+{
+    r->magic = RECORD_MAGIC;
+    r->type = type;
+    r->size = size;
+    r->first = dev->first_track;
+    r->last = dev->last_track;
+    r->leadout = dev->tracks[0].lba;
+}
+
+
+/* restore_sums:
+ *  Mark the tracks with sums in E as read in full, with those checksums.
+ *  VERIFIED says whether every track of the TOC matched.
+ */
+static void restore_sums(cd_device *dev, const Entry *e, int verified)
+{
+    const SumsRecord *s;
+    Checksum *c;
+    int t;
+
+    for (t = dev->first_track; t <= dev->last_track; t++) {
+	s = get_sums(dev->cache, e, t);
+	if (!s)
+	    continue;
+	c = &dev->sums[t];
+	c->next = -1;
+	c->complete = 1;
+	c->unverified = !verified;
+	c->crc = s->crc;
+	c->ar_lo = s->ar_lo;
+	c->ar_hi = s->ar_hi;
+    }
+}
+
+
+/* _cd_cache_read_toc:
+ *  If DEV has a cache and its driver can read just the fingerprint,
+ *  look the disc up and fill in the TOC and checksums.  Return 1 if the
+ *  disc was found, zero if not, or -1 on error.  Call with the lock
+ *  held.
+ */
+int _cd_cache_read_toc(cd_device *dev)
+{
+    const Entry *e;
+    const RecordTrack *tr;
+    int first, last, leadout, t;
+
+    if ((!dev->cache) || (!dev->driver->read_toc_header))
+	return 0;
+
+    if (dev->driver->read_toc_header(dev, &first, &last, &leadout) != 0)
+	return -1;
+
+    if ((first < 1) || (last > CD_MAX_TRACKS) || (first > last))
+	return 0;
+
+    e = find(dev->cache, first, last, leadout);
+    tr = (e) ? get_toc(dev->cache, e) : NULL;
+    if (!tr)
+	return 0;
+
+    for (t = first; t <= last; t++) {
+	dev->tracks[t].ctrl = tr[t - first].ctrl;
+	dev->tracks[t].lba = tr[t - first].lba;
+    }
+    dev->tracks[0].ctrl = CDROM_DATA_TRACK;
+    dev->tracks[0].lba = leadout;
+    dev->first_track = first;
+    dev->last_track = last;
+
+    restore_sums(dev, e, 0);
+    return 1;
+}
+
+
+/* _cd_cache_add_toc:
+ *  The TOC has just been read from the drive.  Bring back the checksums
+ *  if the disc is known, or remember it if not.  Call with the lock
+ *  held.
+ */
+void _cd_cache_add_toc(cd_device *dev)
+{
+    const Entry *e;
+    const RecordTrack *tr;
+    unsigned char buf[sizeof(Record) + CD_MAX_TRACKS * sizeof(RecordTrack)];
+    RecordTrack *out = (RecordTrack *)(buf + sizeof(Record));
+    int first = dev->first_track, last = dev->last_track;
+    int n = last - first + 1, t, same;
+
+    if ((!dev->cache) || (first < 1) || (last > CD_MAX_TRACKS))
+	return;
+
+    e = find(dev->cache, first, last, dev->tracks[0].lba);
+    tr = (e) ? get_toc(dev->cache, e) : NULL;
+    if (tr) {
+	for (t = first, same = 1; (t <= last) && same; t++)
+	    same = (tr[t - first].ctrl == dev->tracks[t].ctrl) &&
+		   (tr[t - first].lba == dev->tracks[t].lba);
+	if (same) {
+	    restore_sums(dev, e, 1);
+	    return;
+	}
+    }
+
+    fill_record(dev, (Record *)buf, RECORD_TOC,
+		sizeof(Record) + n * sizeof(RecordTrack));
+    for (t = first; t <= last; t++) {
+	out[t - first].ctrl = dev->tracks[t].ctrl;
+	out[t - first].lba = dev->tracks[t].lba;
+    }
+    append(dev->cache, buf, sizeof(Record) + n * sizeof(RecordTrack));
+}
+
+
+/* _cd_cache_add_sums:
+ *  TRACK has just been read in full: remember its checksums.  Call with
+ *  the lock held.
+ */
+void _cd_cache_add_sums(cd_device *dev, int track)
+{
+    const Entry *e;
+    const SumsRecord *old = NULL;
+    SumsRecord s;
+
+    if ((!dev->cache) || (track > CD_MAX_TRACKS))
+	return;
+
+    /* Reading a track again usually gives the same sums. */
+    e = find(dev->cache, dev->first_track, dev->last_track, dev->tracks[0].lba);
+    if (e)
+	old = get_sums(dev->cache, e, track);
+    if ((old) && (old->crc == dev->sums[track].crc) &&
+	(old->ar_lo == dev->sums[track].ar_lo) &&
+	(old->ar_hi == dev->sums[track].ar_hi))
+	return;
+
+    memset(&s, 0, sizeof s);
+    fill_record(dev, &s.r, RECORD_SUMS, sizeof s);
+    s.track = track;
+    s.crc = dev->sums[track].crc;
+    s.ar_lo = dev->sums[track].ar_lo;
+    s.ar_hi = dev->sums[track].ar_hi;
+    append(dev->cache, &s, sizeof s);
+}
+
+
+/* _cd_cache_close:
+ *  Call with the lock held.
+ */
+void _cd_cache_close(cd_device *dev)
+{
+    struct Cache *c = dev->cache;
+    int i;
+
+    if (c) {
+	if (c->map)
+	    munmap((void *)c->map, c->size);
+	for (i = 0; i < c->nslots; i++)
+	    free(c->slots[i]);
+	free(c->slots);
+	close(c->fd);
+	free(c);
+	dev->cache = NULL;
+    }
+}
+
+
+/* cd_set_cache:
+ *  Keep the TOCs of discs seen in DEV in the file PATH, or stop if PATH
+ *  is NULL.  Return zero on success.
+ */
+int cd_set_cache(cd_device *dev, const char *path)
+{
+    struct Cache *c = NULL;
+    int ret = 0;
+
+    pthread_mutex_lock(&dev->lock);
+
+    _cd_cache_close(dev);
+
+    if (path) {
+	c = calloc(1, sizeof(struct Cache));
+	if (c) {
+	    c->fd = -1;
+	    c->nslots = MIN_SLOTS;
+	    c->slots = calloc(c->nslots, sizeof(Entry *));
+	}
+	if ((c) && (c->slots))
+	    c->fd = open(path, O_RDWR | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+	if ((!c) || (c->fd < 0)) {
+	    _cd_copy_error();
+	    if (c)
+		free(c->slots);
+	    free(c);
+	    ret = -1;
+	}
+	else {
+	    dev->cache = c;
+	    if (dev->toc_valid)
+		_cd_cache_add_toc(dev);
+	}
+    }
+
+    pthread_mutex_unlock(&dev->lock);
+    return ret;
+}
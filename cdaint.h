@@ -0,0 +1,273 @@
+/* libcda; internals shared by the Linux component and its drivers.
+ *
+ * Not for use by applications.
+ */
+
+#ifndef __included_cdaint_h
+#define __included_cdaint_h
+
+#include <stdint.h>
+#include <pthread.h>
+#include <linux/cdrom.h>
+#include "libcda.h"
+
+
+#define MIN(x,y)     (((x) < (y)) ? (x) : (y))
+#define MAX(x,y)     (((x) > (y)) ? (x) : (y))
+#define MID(x,y,z)   MAX((x), MIN((y), (z)))
+
+
+typedef struct {
+    int ctrl;		/* CDROM_DATA_TRACK etc. */
+    int lba;
+} Track;
+
+
+/* Drive status, as last seen.  Written only with the command lock held
+ * and read without it, so it is protected by a sequence counter.
+ */
+typedef struct {
+    int seq;
+    int audiostatus;	/* CDROM_AUDIO_* */
+    int track;
+    int lba;		/* position when sampled */
+    int track_start;	/* of TRACK, or 0 */
+    int track_end;	/* of TRACK, or -1 if not known */
+    long time;		/* when sampled */
+} Status;
+
+
+/* What a driver reports from the Q sub-channel. */
+typedef struct {
+    int audiostatus;	/* CDROM_AUDIO_* */
+    int track;
+    int abs_lba;
+    int rel_lba;
+} Subchnl;
+
+
+/* Checksums of a track as it is extracted, see checksum.c. */
+typedef struct {
+    int next;		/* LBA expected next, or -1 if out of order */
+    int complete;
+    int unverified;	/* restored for a disc matched only by its TOC header */
+    uint32_t crc;	/* running, not yet inverted */
+    uint32_t ar_lo, ar_hi;	/* sums of the halves of AccurateRip products */
+} Checksum;
+
+
+/* Work for a worker pool, see pool.c.  RUN is called on one of the
+ * workers, and may free the job.
+ */
+typedef struct Job {
+    void (*run)(struct Job *job);
+    struct Job *next, *prev;	/* for the pool's queues */
+} Job;
+
+
+/* An emulated audio transport, for drivers with no drive to play. */
+typedef struct {
+    int audiostatus;	/* CDROM_AUDIO_* */
+    int lba, end;	/* where the clock started, and stops */
+    double time;	/* when it started */
+} Transport;
+
+
+/* Driver functions return zero on success, or set cd_error and return
+ * -1.  They are called with the command lock held.  MAP_AUDIO and
+ * READ_TOC_HEADER may be NULL if the driver can't do them.
+ */
+typedef struct Driver {
+    const char *name;
+    int (*open)(cd_device *dev, const char *path);
+    void (*close)(cd_device *dev);
+    int (*read_toc)(cd_device *dev);
+    int (*media_changed)(cd_device *dev);
+    int (*max_read_frames)(cd_device *dev);
+    int (*read_audio)(cd_device *dev, int lba, int nframes, unsigned char *buf);
+    int (*play)(cd_device *dev, int lba0, int lba1);
+    int (*pause)(cd_device *dev);
+    int (*resume)(cd_device *dev);
+    int (*stop)(cd_device *dev);
+    int (*get_subchnl)(cd_device *dev, Subchnl *s);
+    int (*get_volume)(cd_device *dev, int *c0, int *c1);
+    int (*set_volume)(cd_device *dev, int c0, int c1);
+    int (*eject)(cd_device *dev);
+    int (*close_tray)(cd_device *dev);
+    const void *(*map_audio)(cd_device *dev, int lba, int nframes);
+    int (*read_toc_header)(cd_device *dev, int *first, int *last,
+			   int *leadout);
+} Driver;
+
+
+struct cd_device {
+    const Driver *driver;
+    int fd;
+    void *priv;		/* the driver's own */
+    int timeout;	/* per command, milliseconds */
+    pthread_mutex_t lock;
+    Status status;
+
+    /* read_toc fills these in; leadout is kept at tracks[0]. */
+    int toc_valid;
+    int toc_unverified;	/* the tracks came from the cache on a header match */
+    int first_track, last_track;
+    Track tracks[CDROM_LEADOUT + 1];
+    Checksum sums[CDROM_LEADOUT + 1];	/* reset with the TOC */
+    long last_media_check;
+
+    int batch;		/* frames per read request */
+    int batch_max;	/* largest the drive accepted */
+    int batch_tuned;	/* stopped growing */
+    double batch_rate;	/* frames per second at BATCH */
+    int next_lba;	/* where the last read ended */
+
+    int volume;		/* left | right << 8, for gain.c; atomic */
+
+    struct Async *async;	/* see async.c; set once, atomically */
+    pthread_mutex_t async_lock;	/* for starting it, not the command lock */
+    cd_request *ready_req;	/* the first TOC read, if lazy */
+    struct Jitter *jitter;	/* see jitter.c */
+    struct Stats *stats;	/* see stats.c */
+    int stats_on;
+    struct Cache *cache;	/* see cache.c */
+};
+
+
+/* A run of tracks in a stream.  Spans are only ever appended, and the
+ * readahead thread follows NEXT without a lock.
+ */
+typedef struct Span {
+    int first, last;	/* tracks */
+    int offset;		/* frame of the stream it starts at */
+    int length;		/* frames */
+    struct Span *next;
+    int lba[];		/* where each track starts, then the end */
+} Span;
+
+
+struct cd_stream {
+    cd_device *dev;
+    Span *spans, *last_span;
+    int length;		/* frames in all spans; grows atomically */
+    int pos;		/* frames from the start */
+    struct Readahead *ra;	/* see readahead.c */
+    int rate, format;	/* what readahead delivers */
+    int gain[2];	/* applied to what is read, see gain.c */
+};
+
+
+/* What stats.c counts: public functions, then ioctls. */
+#define STAT_PLAY		0
+#define STAT_PLAY_RANGE		1
+#define STAT_PLAY_FROM		2
+#define STAT_CURRENT_TRACK	3
+#define STAT_PAUSE		4
+#define STAT_RESUME		5
+#define STAT_IS_PAUSED		6
+#define STAT_STOP		7
+#define STAT_GET_TRACKS		8
+#define STAT_IS_AUDIO		9
+#define STAT_GET_VOLUME		10
+#define STAT_SET_VOLUME		11
+#define STAT_EJECT		12
+#define STAT_CLOSE		13
+#define STAT_READ_AUDIO		14
+#define STAT_MAP_AUDIO		15
+#define STAT_STREAM_READ	16
+#define STAT_STREAM_PULL	17
+#define STAT_GET_POSITION	18
+#define STAT_STREAM_OPEN	19
+#define STAT_STREAM_SEEK	20
+#define STAT_STREAM_QUEUE	21
+#define STAT_GET_CHECKSUMS	22
+#define STAT_GET_DISC_IDS	23
+#define STAT_GET_LAYOUT		24
+#define STAT_RIP		25
+#define STAT_READTOCHDR		26
+#define STAT_READTOCENTRY	27
+#define STAT_MEDIA_CHANGED	28
+#define STAT_DRIVE_STATUS	29
+#define STAT_READAUDIO		30
+#define STAT_PLAYMSF		31
+#define STAT_PLAYTRKIND		32
+#define STAT_CDROMPAUSE		33
+#define STAT_CDROMRESUME	34
+#define STAT_CDROMSTOP		35
+#define STAT_CDROMEJECT		36
+#define STAT_CLOSETRAY		37
+#define STAT_SUBCHNL		38
+#define STAT_VOLREAD		39
+#define STAT_VOLCTRL		40
+#define STAT_SG_IO		41
+#define STAT_COUNT		42
+
+
+/* Jitter correction reads this many frames before and after each
+ * batch, to find where it joins the previous one.
+ */
+#define JITTER_OVERLAP	1
+#define JITTER_TAIL	1
+
+
+extern const Driver _cd_driver_ioctl;
+extern const Driver _cd_driver_sg;
+extern const Driver _cd_driver_image;
+extern const Driver _cd_driver_emu;
+
+void _cd_set_error(int code, const char *s);
+void _cd_copy_error(void);
+
+int _cd_read_batch(cd_device *dev, int lba, int nframes, unsigned char *buf);
+int _cd_track_bounds(cd_device *dev, int track, int *start, int *end);
+int _cd_get_toc(cd_device *dev, int *first, int *last, Track *tracks,
+		int *unverified);
+
+void _cd_async_shutdown(cd_device *dev);
+void _cd_async_signal(cd_device *dev);
+
+int _cd_jitter_read(cd_device *dev, int lba, int nframes, unsigned char *buf);
+void _cd_jitter_free(cd_device *dev);
+
+void _cd_checksum_reset(cd_device *dev);
+void _cd_checksum_update(cd_device *dev, int lba, int nframes,
+			 const unsigned char *buf);
+
+int _cd_cache_read_toc(cd_device *dev);
+void _cd_cache_add_toc(cd_device *dev);
+void _cd_cache_add_sums(cd_device *dev, int track);
+void _cd_cache_close(cd_device *dev);
+
+uint64_t _cd_stats_start(cd_device *dev);
+void _cd_stats_end(cd_device *dev, int what, uint64_t t0, int failed);
+void _cd_stats_free(cd_device *dev);
+
+void _cd_gain_init(cd_stream *s);
+void _cd_apply_gain(cd_stream *s, void *buf, int n, int format);
+
+int _cd_resample_check(int rate);
+struct Resampler *_cd_resampler_create(int rate, int format, int max_in);
+void _cd_resampler_destroy(struct Resampler *rs);
+int _cd_resample_room(struct Resampler *rs, int n);
+int _cd_resample_bytes(int format);
+int _cd_resample(struct Resampler *rs, const int16_t *in, int n, void *out);
+int _cd_resample_flush(struct Resampler *rs, void *out);
+
+void _cd_transport_play(Transport *tp, int lba0, int lba1);
+void _cd_transport_pause(Transport *tp);
+void _cd_transport_resume(Transport *tp);
+void _cd_transport_stop(Transport *tp);
+void _cd_transport_subchnl(cd_device *dev, Transport *tp, Subchnl *s);
+
+struct Pool *_cd_pool_create(int nthreads);
+void _cd_pool_destroy(struct Pool *pool);
+int _cd_pool_threads(struct Pool *pool);
+void _cd_pool_submit(struct Pool *pool, Job *job);
+
+int _cd_stream_locate(cd_stream *s, int pos, int *left);
+
+void _cd_readahead_stop(cd_stream *s);
+int _cd_readahead_restart(cd_stream *s);
+int _cd_readahead_tell(cd_stream *s);
+
+#endif
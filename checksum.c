@@ -0,0 +1,394 @@
+/* libcda; checksums of extracted audio for the Linux component.
+ *
+ * As audio is read, each track's CRC32 (as EAC reports it) and
+ * AccurateRip v1 and v2 checksums are worked out on the way through,
+ * so a rip can be verified without reading it again.  A track only
+ * counts if it is read from its first frame to its last in order;
+ * starting again at the first frame starts the sums again.
+ *
+ * The CRC folds 64 bytes at a time with PCLMULQDQ, and the AccurateRip
+ * products are done with SSE2 or AVX2, where the CPU has them.
+ */
+
+#include <string.h>
+#include <stdint.h>
+#include "cdaint.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define HAVE_X86_SIMD
+#endif
+
+
+/* AccurateRip leaves out the first five frames of the first track,
+ * bar one sample, and the last five frames of the last.
+ */
+#define AR_SKIP_START	(5 * CD_FRAME_SAMPLES - 1)
+#define AR_SKIP_END	(5 * CD_FRAME_SAMPLES)
+
+
+/* Kernels continue a CRC (not inverted) over N bytes at P. */
+typedef uint32_t (*CRC)(uint32_t crc, const unsigned char *p, int n);
+
+/* Kernels add M * P[i] for M = MUL, MUL+1, ... to the sums of the low
+ * and high words of the products, over N samples.
+ */
+typedef void (*AR)(const uint32_t *p, int n, uint32_t mul,
+		   uint32_t *lo, uint32_t *hi);
+
+
+static uint32_t crc_table[256];
+
+
+static void make_crc_table(void)
+{
+    uint32_t c;
+    int i, k;
+
+    for (i = 0; i < 256; i++) {
+	c = i;
+	for (k = 0; k < 8; k++)
+	    c = (c & 1) ? 0xedb88320 ^ (c >> 1) : c >> 1;
+	crc_table[i] = c;
+    }
+}
+
+
+static uint32_t crc_c(uint32_t crc, const unsigned char *p, int n)
+{
+    while (n--)
+	crc = crc_table[(crc ^ *p++) & 0xff] ^ (crc >> 8);
+
+    return crc;
+}
+
+
+static void ar_c(const uint32_t *p, int n, uint32_t mul,
+		 uint32_t *lo, uint32_t *hi)
+{
+    uint64_t x;
+    int i;
+
+    for (i = 0; i < n; i++) {
+	x = (uint64_t)p[i] * (mul + i);
+	*lo += (uint32_t)x;
+	*hi += (uint32_t)(x >> 32);
+    }
+}
+
+
+#ifdef HAVE_X86_SIMD
+
+/* crc_pclmul:
+ *  Fold the data four 128-bit lanes at a time, then into one lane, then
+ *  reduce that to 32 bits, as in Intel's "Fast CRC Computation for
+ *  Generic Polynomials Using PCLMULQDQ", with the constants for the
+ *  bit-reflected CRC32 polynomial.  N must be a multiple of 16, and at
+ *  least 64.
+ */
+__attribute__((target("pclmul,sse4.1")))
+static uint32_t crc_pclmul(uint32_t crc, const unsigned char *p, int n)
+{
+    const __m128i k1k2 = _mm_set_epi64x(0x1c6e41596LL, 0x154442bd4LL);
+    const __m128i k3k4 = _mm_set_epi64x(0x0ccaa009eLL, 0x1751997d0LL);
+    const __m128i k5 = _mm_set_epi64x(0, 0x163cd6124LL);
+    const __m128i poly = _mm_set_epi64x(0x1f7011641LL, 0x1db710641LL);
+    const __m128i mask32 = _mm_set_epi32(0, 0, 0, -1);
+    __m128i x0, x1, x2, x3, t;
+
+    x0 = _mm_xor_si128(_mm_loadu_si128((const __m128i *)p),
+		       _mm_cvtsi32_si128(crc));
+    x1 = _mm_loadu_si128((const __m128i *)(p + 16));
+    x2 = _mm_loadu_si128((const __m128i *)(p + 32));
+    x3 = _mm_loadu_si128((const __m128i *)(p + 48));
+    p += 64;
+    n -= 64;
+
+    for (; n >= 64; n -= 64, p += 64) {
+#define FOLD(x, k, off)							\
+	t = _mm_clmulepi64_si128(x, k, 0x11);				\
+	x = _mm_clmulepi64_si128(x, k, 0x00);				\
+	x = _mm_xor_si128(x, t);					\
+	x = _mm_xor_si128(x, _mm_loadu_si128((const __m128i *)(p + off)))
+	FOLD(x0, k1k2, 0);
+	FOLD(x1, k1k2, 16);
+	FOLD(x2, k1k2, 32);
+	FOLD(x3, k1k2, 48);
+    }
+
+#define FOLD_INTO(x, y, k)						\
+	t = _mm_clmulepi64_si128(x, k, 0x11);				\
+	x = _mm_clmulepi64_si128(x, k, 0x00);				\
+	x = _mm_xor_si128(_mm_xor_si128(x, t), y)
+    FOLD_INTO(x0, x1, k3k4);
+    FOLD_INTO(x0, x2, k3k4);
+    FOLD_INTO(x0, x3, k3k4);
+
+    for (; n >= 16; n -= 16, p += 16) {
+	FOLD(x0, k3k4, 0);
+    }
+#undef FOLD
+#undef FOLD_INTO
+
+    /* 128 bits to 64, then to 32 with Barrett reduction. */
+    t = _mm_clmulepi64_si128(k3k4, x0, 0x01);
+    x0 = _mm_xor_si128(_mm_srli_si128(x0, 8), t);
+
+    t = _mm_srli_si128(x0, 4);
+    x0 = _mm_clmulepi64_si128(_mm_and_si128(x0, mask32), k5, 0x00);
+    x0 = _mm_xor_si128(x0, t);
+
+    t = x0;
+    x0 = _mm_clmulepi64_si128(_mm_and_si128(x0, mask32), poly, 0x10);
+    x0 = _mm_clmulepi64_si128(_mm_and_si128(x0, mask32), poly, 0x00);
+    x0 = _mm_xor_si128(x0, t);
+
+    return _mm_extract_epi32(x0, 1);
+}
+
+
+static uint32_t crc_fast(uint32_t crc, const unsigned char *p, int n)
+{
+    int m = (n >= 64) ? n & ~15 : 0;
+
+    if (m)
+	crc = crc_pclmul(crc, p, m);
+
+    return crc_c(crc, p + m, n - m);
+}
+
+
+/* The even and odd samples are multiplied separately, as PMULUDQ only
+ * takes every other 32-bit lane.  Sums are kept in 64-bit lanes and
+ * only the low 32 bits of each matter.
+ */
+__attribute__((target("sse2")))
+static void ar_sse2(const uint32_t *p, int n, uint32_t mul,
+		    uint32_t *lo, uint32_t *hi)
+{
+    __m128i m = _mm_set_epi32(mul + 3, mul + 2, mul + 1, mul);
+    __m128i four = _mm_set1_epi32(4);
+    __m128i low = _mm_set_epi32(0, -1, 0, -1);
+    __m128i slo = _mm_setzero_si128(), shi = _mm_setzero_si128();
+    __m128i x, e, o;
+    uint64_t r[2];
+    int i;
+
+    for (i = 0; i + 4 <= n; i += 4) {
+	x = _mm_loadu_si128((const __m128i *)(p + i));
+	e = _mm_mul_epu32(x, m);
+	o = _mm_mul_epu32(_mm_srli_epi64(x, 32), _mm_srli_epi64(m, 32));
+	slo = _mm_add_epi64(slo, _mm_and_si128(e, low));
+	slo = _mm_add_epi64(slo, _mm_and_si128(o, low));
+	shi = _mm_add_epi64(shi, _mm_srli_epi64(e, 32));
+	shi = _mm_add_epi64(shi, _mm_srli_epi64(o, 32));
+	m = _mm_add_epi32(m, four);
+    }
+
+    _mm_storeu_si128((__m128i *)r, slo);
+    *lo += (uint32_t)(r[0] + r[1]);
+    _mm_storeu_si128((__m128i *)r, shi);
+    *hi += (uint32_t)(r[0] + r[1]);
+
+    ar_c(p + i, n - i, mul + i, lo, hi);
+}
+
+
+__attribute__((target("avx2")))
+static void ar_avx2(const uint32_t *p, int n, uint32_t mul,
+		    uint32_t *lo, uint32_t *hi)
+{
+    __m256i m = _mm256_add_epi32(_mm256_set1_epi32(mul),
+				 _mm256_set_epi32(7, 6, 5, 4, 3, 2, 1, 0));
+    __m256i eight = _mm256_set1_epi32(8);
+    __m256i low = _mm256_set1_epi64x(0xffffffff);
+    __m256i slo = _mm256_setzero_si256(), shi = _mm256_setzero_si256();
+    __m256i x, e, o;
+    uint64_t r[4];
+    int i;
+
+    for (i = 0; i + 8 <= n; i += 8) {
+	x = _mm256_loadu_si256((const __m256i *)(p + i));
+	e = _mm256_mul_epu32(x, m);
+	o = _mm256_mul_epu32(_mm256_srli_epi64(x, 32), _mm256_srli_epi64(m, 32));
+	slo = _mm256_add_epi64(slo, _mm256_and_si256(e, low));
+	slo = _mm256_add_epi64(slo, _mm256_and_si256(o, low));
+	shi = _mm256_add_epi64(shi, _mm256_srli_epi64(e, 32));
+	shi = _mm256_add_epi64(shi, _mm256_srli_epi64(o, 32));
+	m = _mm256_add_epi32(m, eight);
+    }
+
+    _mm256_storeu_si256((__m256i *)r, slo);
+    *lo += (uint32_t)(r[0] + r[1] + r[2] + r[3]);
+    _mm256_storeu_si256((__m256i *)r, shi);
+    *hi += (uint32_t)(r[0] + r[1] + r[2] + r[3]);
+
+    ar_c(p + i, n - i, mul + i, lo, hi);
+}
+
+#endif
+
+
+static CRC crc;
+static AR ar;
+static pthread_once_t kernels_once = PTHREAD_ONCE_INIT;
+
+
+static void choose_kernels(void)
+{
+    make_crc_table();
+    crc = crc_c;
+    ar = ar_c;
+
+#ifdef HAVE_X86_SIMD
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("pclmul") && __builtin_cpu_supports("sse4.1"))
+	crc = crc_fast;
+    if (__builtin_cpu_supports("avx2"))
+	ar = ar_avx2;
+    else if (__builtin_cpu_supports("sse2"))
+	ar = ar_sse2;
+#endif
+}
+
+
+/* _cd_checksum_reset:
+ *  Forget all sums, e.g. because the disc has changed.
+ */
+void _cd_checksum_reset(cd_device *dev)
+{
+    int t;
+
+    pthread_once(&kernels_once, choose_kernels);
+
+    memset(dev->sums, 0, sizeof dev->sums);
+    for (t = 0; t <= CDROM_LEADOUT; t++)
+	dev->sums[t].next = -1;
+}
+
+
+/* last_audio_track:
+ *  Return the last audio track, which AccurateRip treats as the last.
+ */
+static int last_audio_track(cd_device *dev)
+{
+    int t = dev->last_track;
+
+    while ((t > dev->first_track) && (dev->tracks[t].ctrl & CDROM_DATA_TRACK))
+	t--;
+
+    return t;
+}
+
+
+/* add:
+ *  Add NFRAMES frames at BUF, starting at frame FRAME of TRACK, to its
+ *  sums.
+ */
+static void add(cd_device *dev, int track, int frame, int nframes,
+		const unsigned char *buf)
+{
+    Checksum *c = &dev->sums[track];
+    int len = (track == dev->last_track ? dev->tracks[0].lba
+					: dev->tracks[track + 1].lba)
+	      - dev->tracks[track].lba;
+    int total = len * CD_FRAME_SAMPLES;
+    int from = frame * CD_FRAME_SAMPLES;
+    int to = from + nframes * CD_FRAME_SAMPLES;
+    int lo = from, hi = to;
+
+    c->crc = crc(c->crc, buf, nframes * CD_FRAME_BYTES);
+
+    /* Sample I (from zero) is multiplied by I + 1. */
+    if (track == dev->first_track)
+	lo = MAX(lo, AR_SKIP_START);
+    if (track == last_audio_track(dev))
+	hi = MIN(hi, total - AR_SKIP_END);
+    if (lo < hi)
+	ar((const uint32_t *)buf + (lo - from), hi - lo, lo + 1,
+	   &c->ar_lo, &c->ar_hi);
+
+    c->next += nframes;
+    if (frame + nframes == len) {
+	c->complete = 1;
+	_cd_cache_add_sums(dev, track);
+    }
+}
+
+
+/* _cd_checksum_update:
+ *  NFRAMES frames at LBA have just been read into BUF: add them to the
+ *  sums of the tracks they belong to.  Call with the lock held.
+ */
+void _cd_checksum_update(cd_device *dev, int lba, int nframes,
+			 const unsigned char *buf)
+{
+    Checksum *c;
+    int t, end, n;
+
+    if (!dev->toc_valid)
+	return;
+
+    for (t = dev->first_track; (t <= dev->last_track) && (nframes > 0); t++) {
+	end = (t == dev->last_track) ? dev->tracks[0].lba : dev->tracks[t+1].lba;
+	if (lba >= end)
+	    continue;
+	if (dev->tracks[t].ctrl & CDROM_DATA_TRACK)
+	    break;
+
+	n = MIN(nframes, end - lba);
+	c = &dev->sums[t];
+
+	/* Starting the track again starts the sums again. */
+	if (lba == dev->tracks[t].lba) {
+	    memset(c, 0, sizeof(Checksum));
+	    c->crc = 0xffffffff;
+	    c->next = lba;
+	}
+
+	if ((lba == c->next) && !c->complete)
+	    add(dev, t, lba - dev->tracks[t].lba, n, buf);
+	else if (!c->complete)
+	    c->next = -1;
+
+	lba += n;
+	nframes -= n;
+	buf += n * CD_FRAME_BYTES;
+    }
+}
+
+
+/* cd_get_checksums:
+ *  Fill in OUT with the checksums of TRACK.  Return 1 if the whole
+ *  track has been read in order and they are good, 2 if they came from
+ *  the cache for a disc which may not be this one, zero if not (yet),
+ *  or -1 on error.
+ */
+int cd_get_checksums(cd_device *dev, int track, cd_checksums *out)
+{
+    uint64_t t = _cd_stats_start(dev);
+    Checksum *c;
+    int ret = -1;
+
+    memset(out, 0, sizeof(cd_checksums));
+
+    pthread_mutex_lock(&dev->lock);
+
+    if (!dev->toc_valid)
+	_cd_set_error(CDERR_NO_DISC, "No TOC");
+    else if ((track < dev->first_track) || (track > dev->last_track))
+	_cd_set_error(CDERR_BAD_TRACK, "Track out of range");
+    else {
+	c = &dev->sums[track];
+	ret = c->complete ? (c->unverified ? 2 : 1) : 0;
+	if (ret) {
+	    out->crc32 = c->crc ^ 0xffffffff;
+	    out->accuraterip_v1 = c->ar_lo;
+	    out->accuraterip_v2 = c->ar_lo + c->ar_hi;
+	}
+    }
+
+    pthread_mutex_unlock(&dev->lock);
+    _cd_stats_end(dev, STAT_GET_CHECKSUMS, t, ret < 0);
+    return ret;
+}
@@ -0,0 +1,264 @@
+/* libcda; disc identifiers for the Linux component.
+ *
+ * The freedb (CDDB), MusicBrainz and AccurateRip disc IDs are all sums
+ * or hashes of the track offsets, so they are worked out from a copy of
+ * the cached TOC without asking the drive anything more.
+ *
+ * On an Enhanced CD (audio, then a data track in a second session)
+ * MusicBrainz only counts the audio session, whose leadout is 11400
+ * frames before the data track.  AccurateRip leaves out the starts of
+ * data tracks but keeps their numbers and the real leadout, as EAC,
+ * CUETools and whipper do.  freedb counts everything.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include "cdaint.h"
+
+
+/* LBAs are offset by the two second pregap in all three IDs. */
+#define PREGAP		150
+
+/* Lead-out, lead-in and pregap of the second session of an Enhanced CD. */
+#define SESSION_GAP	11400
+
+
+/* SHA-1, for MusicBrainz. */
+
+typedef struct {
+    uint32_t h[5];
+    unsigned char block[64];
+    int used;
+    uint64_t bytes;
+} Sha1;
+
+
+#define ROL(x, n)	(((x) << (n)) | ((x) >> (32 - (n))))
+
+
+static void sha1_block(Sha1 *c, const unsigned char *p)
+{
+    uint32_t w[80], a, b, d, e, f, k, t, cc;
+    int i;
+
+    for (i = 0; i < 16; i++)
+	w[i] = ((uint32_t)p[4*i] << 24) | (p[4*i+1] << 16) |
+	       (p[4*i+2] << 8) | p[4*i+3];
+    for (; i < 80; i++)
+	w[i] = ROL(w[i-3] ^ w[i-8] ^ w[i-14] ^ w[i-16], 1);
+
+    a = c->h[0]; b = c->h[1]; cc = c->h[2]; d = c->h[3]; e = c->h[4];
+
+    for (i = 0; i < 80; i++) {
+	if (i < 20)
+	    f = (b & cc) | (~b & d), k = 0x5a827999;
+	else if (i < 40)
+	    f = b ^ cc ^ d, k = 0x6ed9eba1;
+	else if (i < 60)
+	    f = (b & cc) | (b & d) | (cc & d), k = 0x8f1bbcdc;
+	else
+	    f = b ^ cc ^ d, k = 0xca62c1d6;
+
+	t = ROL(a, 5) + f + e + k + w[i];
+	e = d; d = cc; cc = ROL(b, 30); b = a; a = t;
+    }
+
+    c->h[0] += a; c->h[1] += b; c->h[2] += cc; c->h[3] += d; c->h[4] += e;
+}
+
+
+static void sha1_init(Sha1 *c)
+{
+    c->h[0] = 0x67452301;
+    c->h[1] = 0xefcdab89;
+    c->h[2] = 0x98badcfe;
+    c->h[3] = 0x10325476;
+    c->h[4] = 0xc3d2e1f0;
+    c->used = 0;
+    c->bytes = 0;
+}
+
+
+static void sha1_update(Sha1 *c, const void *data, int n)
+{
+    const unsigned char *p = data;
+
+    c->bytes += n;
+    while (n-- > 0) {
+	c->block[c->used++] = *p++;
+	if (c->used == 64) {
+	    sha1_block(c, c->block);
+	    c->used = 0;
+	}
+    }
+}
+
+
+static void sha1_final(Sha1 *c, unsigned char out[20])
+{
+    uint64_t bits = c->bytes * 8;
+    unsigned char pad = 0x80;
+    int i;
+
+    sha1_update(c, &pad, 1);
+    pad = 0;
+    while (c->used != 56)
+	sha1_update(c, &pad, 1);
+    for (i = 7; i >= 0; i--) {
+	pad = bits >> (i * 8);
+	sha1_update(c, &pad, 1);
+    }
+
+    for (i = 0; i < 20; i++)
+	out[i] = c->h[i / 4] >> (24 - (i % 4) * 8);
+}
+
+
+/* base64:
+ *  Encode N bytes of IN as MusicBrainz does: base64 with `.', `_' and
+ *  `-' in place of `+', `/' and `='.
+ */
+static void base64(const unsigned char *in, int n, char *out)
+{
+    static const char digits[] =
+	"ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789._";
+    uint32_t v;
+    int i;
+
+    for (i = 0; i < n; i += 3) {
+	v = in[i] << 16;
+	if (i + 1 < n) v |= in[i + 1] << 8;
+	if (i + 2 < n) v |= in[i + 2];
+
+	*out++ = digits[(v >> 18) & 63];
+	*out++ = digits[(v >> 12) & 63];
+	*out++ = (i + 1 < n) ? digits[(v >> 6) & 63] : '-';
+	*out++ = (i + 2 < n) ? digits[v & 63] : '-';
+    }
+
+    *out = 0;
+}
+
+
+static int digit_sum(int n)
+{
+    int s = 0;
+
+    while (n > 0) {
+	s += n % 10;
+	n /= 10;
+    }
+
+    return s;
+}
+
+
+static unsigned long freedb_id(int first, int last, const Track *tracks)
+{
+    int t, n = 0, secs;
+
+    for (t = first; t <= last; t++)
+	n += digit_sum((tracks[t].lba + PREGAP) / 75);
+
+    secs = (tracks[0].lba + PREGAP) / 75 - (tracks[first].lba + PREGAP) / 75;
+
+    return ((unsigned long)(n % 0xff) << 24) | (secs << 8) | (last - first + 1);
+}
+
+
+static void musicbrainz_id(int first, int last, int leadout,
+			   const Track *tracks, char *out)
+{
+    unsigned char digest[20];
+    char hex[16];
+    Sha1 c;
+    int t;
+
+    sha1_init(&c);
+
+    sprintf(hex, "%02X%02X", first, last);
+    sha1_update(&c, hex, 4);
+    sprintf(hex, "%08X", leadout + PREGAP);
+    sha1_update(&c, hex, 8);
+
+    for (t = 1; t < 100; t++) {
+	sprintf(hex, "%08X",
+		((t >= first) && (t <= last)) ? tracks[t].lba + PREGAP : 0);
+	sha1_update(&c, hex, 8);
+    }
+
+    sha1_final(&c, digest);
+    base64(digest, 20, out);
+}
+
+
+/* accuraterip_id:
+ *  Work out the two AccurateRip sums over the audio tracks and the
+ *  lead-out, each weighted by its track number.  Return the number of
+ *  audio tracks.
+ */
+static int accuraterip_id(int first, int last, const Track *tracks,
+			  cd_disc_ids *ids)
+{
+    unsigned long id1 = 0, id2 = 0;
+    int t, n = 0;
+
+    for (t = first; t <= last; t++) {
+	if (tracks[t].ctrl & CDROM_DATA_TRACK)
+	    continue;
+	n++;
+	id1 += tracks[t].lba;
+	id2 += MAX(tracks[t].lba, 1) * t;
+    }
+
+    id1 += tracks[0].lba;
+    id2 += MAX(tracks[0].lba, 1) * (last + 1);
+
+    ids->accuraterip_id1 = id1 & 0xffffffff;
+    ids->accuraterip_id2 = id2 & 0xffffffff;
+    return n;
+}
+
+
+/* cd_get_disc_ids:
+ *  Fill in IDS with the identifiers of the disc in DEV, from the cached
+ *  TOC.  Return zero on success.
+ */
+int cd_get_disc_ids(cd_device *dev, cd_disc_ids *ids)
+{
+    uint64_t t = _cd_stats_start(dev);
+    Track tracks[CDROM_LEADOUT + 1];
+    int first, last, audio_last, leadout, unverified, n;
+
+    memset(ids, 0, sizeof(cd_disc_ids));
+
+    if (_cd_get_toc(dev, &first, &last, tracks, &unverified) != 0) {
+	_cd_stats_end(dev, STAT_GET_DISC_IDS, t, 1);
+	return -1;
+    }
+
+    /* Leave the data session of an Enhanced CD out of MusicBrainz. */
+    audio_last = last;
+    leadout = tracks[0].lba;
+    if ((last > first) && (tracks[last].ctrl & CDROM_DATA_TRACK) &&
+	!(tracks[last - 1].ctrl & CDROM_DATA_TRACK)) {
+	audio_last = last - 1;
+	leadout = tracks[last].lba - SESSION_GAP;
+    }
+
+    ids->unverified = unverified;
+
+    ids->freedb_id = freedb_id(first, last, tracks);
+    sprintf(ids->freedb, "%08x", (unsigned int)ids->freedb_id);
+
+    musicbrainz_id(first, audio_last, leadout, tracks, ids->musicbrainz);
+
+    n = accuraterip_id(first, last, tracks, ids);
+    sprintf(ids->accuraterip, "%03d-%08x-%08x-%08x", n,
+	    (unsigned int)ids->accuraterip_id1,
+	    (unsigned int)ids->accuraterip_id2, (unsigned int)ids->freedb_id);
+
+    _cd_stats_end(dev, STAT_GET_DISC_IDS, t, 0);
+    return 0;
+}
@@ -0,0 +1,325 @@
+/* libcda; finding drives for the Linux component.
+ *
+ * Candidates come from the kernel's list in /proc/sys/dev/cdrom/info
+ * and from /dev/sr*.  Each is opened and asked what it can do on a
+ * thread of its own, so they are all probed at once, and a drive which
+ * hangs in open or an ioctl only holds up the search until the timeout.
+ * Its thread is left to finish by itself.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <limits.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <errno.h>
+#include <time.h>
+#include <sys/ioctl.h>
+#include "cdaint.h"
+
+
+#define MAX_CANDIDATES		32
+#define DEFAULT_PROBE_TIMEOUT	2000	/* milliseconds */
+
+
+typedef struct Search Search;
+
+typedef struct {
+    Search *search;
+    int index;
+} ProbeArg;
+
+
+/* Shared by the caller and the probes; freed by whichever is last. */
+struct Search {
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    int refs;
+    int pending;		/* probes still running */
+    int n;
+    cd_drive_info info[MAX_CANDIDATES];
+    int done[MAX_CANDIDATES];
+    ProbeArg arg[MAX_CANDIDATES];
+};
+
+
+/* add_candidate:
+ *  Add /dev/NAME to S, unless it is there already.
+ */
+static void add_candidate(Search *s, const char *name, int speed)
+{
+    char path[sizeof s->info[0].path];
+    int i;
+
+    if (strlen(name) + 6 > sizeof path)
+	return;
+    sprintf(path, "/dev/%s", name);
+
+    for (i = 0; i < s->n; i++) {
+	if (strcmp(s->info[i].path, path) == 0) {
+	    if (speed)
+		s->info[i].speed = speed;
+	    return;
+	}
+    }
+
+    if (s->n < MAX_CANDIDATES) {
+	strcpy(s->info[s->n].path, path);
+	s->info[s->n].speed = speed;
+	s->n++;
+    }
+}
+
+
+/* read_proc_info:
+ *  Add the drives listed in /proc/sys/dev/cdrom/info to S.  Each line
+ *  there has a label and then a column per drive.
+ */
+static void read_proc_info(Search *s)
+{
+    char names[MAX_CANDIDATES][16];
+    int speeds[MAX_CANDIDATES];
+    char line[512], *p, *tok;
+    int i, n = 0, m = 0;
+    FILE *f;
+
+    f = fopen("/proc/sys/dev/cdrom/info", "re");
+    if (!f)
+	return;
+
+    while (fgets(line, sizeof line, f)) {
+	p = strchr(line, ':');
+	if (!p)
+	    continue;
+	*p++ = 0;
+
+	if (strcmp(line, "drive name") == 0) {
+	    for (tok = strtok(p, " \t\n"); tok && (n < MAX_CANDIDATES);
+		 tok = strtok(NULL, " \t\n")) {
+		strncpy(names[n], tok, sizeof names[n]);
+		names[n++][sizeof names[0] - 1] = 0;
+	    }
+	}
+	else if (strcmp(line, "drive speed") == 0) {
+	    for (tok = strtok(p, " \t\n"); tok && (m < MAX_CANDIDATES);
+		 tok = strtok(NULL, " \t\n"))
+		speeds[m++] = atoi(tok);
+	}
+    }
+
+    fclose(f);
+
+    for (i = 0; i < n; i++)
+	add_candidate(s, names[i], (i < m) ? speeds[i] : 0);
+}
+
+
+/* scan_dev:
+ *  Add the /dev/sr* devices to S.
+ */
+static void scan_dev(Search *s)
+{
+    struct dirent *e;
+    DIR *d;
+
+    d = opendir("/dev");
+    if (!d)
+	return;
+
+    while ((e = readdir(d)) != NULL)
+	if ((strncmp(e->d_name, "sr", 2) == 0) &&
+	    (e->d_name[2] >= '0') && (e->d_name[2] <= '9'))
+	    add_candidate(s, e->d_name, 0);
+
+    closedir(d);
+}
+
+
+/* by_path:
+ *  Sort sr2 before sr10.
+ */
+static int by_path(const void *a, const void *b)
+{
+    const char *x = ((const cd_drive_info *)a)->path;
+    const char *y = ((const cd_drive_info *)b)->path;
+    int lx = strlen(x), ly = strlen(y);
+
+    return (lx != ly) ? lx - ly : strcmp(x, y);
+}
+
+
+/* probe:
+ *  Open the drive at INFO->path and fill in the rest of INFO.  This is
+ *  what may hang.
+ */
+static void probe(cd_drive_info *info)
+{
+    static const struct { int cdc, cap; } caps[] = {
+	{ CDC_CLOSE_TRAY,	CD_CAN_CLOSE_TRAY },
+	{ CDC_OPEN_TRAY,	CD_CAN_EJECT },
+	{ CDC_LOCK,		CD_CAN_LOCK },
+	{ CDC_SELECT_SPEED,	CD_CAN_SELECT_SPEED },
+	{ CDC_MULTI_SESSION,	CD_CAN_MULTISESSION },
+	{ CDC_MCN,		CD_CAN_READ_MCN },
+	{ CDC_PLAY_AUDIO,	CD_CAN_PLAY_AUDIO },
+	{ CDC_CD_R | CDC_CD_RW, CD_CAN_WRITE },
+	{ CDC_DVD,		CD_CAN_READ_DVD }
+    };
+    int fd, cdc, status, i;
+
+    fd = open(info->path, O_RDONLY | O_NONBLOCK | O_CLOEXEC);
+    if (fd < 0) {
+	info->status = (errno == ENOMEDIUM) ? CD_DRIVE_NO_DISC : CD_DRIVE_ERROR;
+	return;
+    }
+
+    cdc = ioctl(fd, CDROM_GET_CAPABILITY, 0);
+    if (cdc < 0) {
+	info->status = CD_DRIVE_ERROR;
+	close(fd);
+	return;
+    }
+
+    for (i = 0; i < (int)(sizeof caps / sizeof caps[0]); i++)
+	if (cdc & caps[i].cdc)
+	    info->caps |= caps[i].cap;
+
+    status = ioctl(fd, CDROM_DRIVE_STATUS, CDSL_CURRENT);
+    switch (status) {
+	case CDS_DISC_OK:
+	    info->status = CD_DRIVE_DISC;
+	    break;
+	case CDS_NO_DISC:
+	    info->status = CD_DRIVE_NO_DISC;
+	    break;
+	case CDS_TRAY_OPEN:
+	    info->status = CD_DRIVE_TRAY_OPEN;
+	    break;
+	case CDS_DRIVE_NOT_READY:
+	    info->status = CD_DRIVE_NOT_READY;
+	    break;
+	default:
+	    info->status = CD_DRIVE_UNKNOWN;
+	    break;
+    }
+
+    close(fd);
+}
+
+
+static void release(Search *s)
+{
+    int refs;
+
+    pthread_mutex_lock(&s->lock);
+    refs = --s->refs;
+    pthread_mutex_unlock(&s->lock);
+
+    if (refs == 0) {
+	pthread_cond_destroy(&s->cond);
+	pthread_mutex_destroy(&s->lock);
+	free(s);
+    }
+}
+
+
+static void *prober(void *arg)
+{
+    ProbeArg *pa = arg;
+    Search *s = pa->search;
+    cd_drive_info info;
+
+    /* The path doesn't change once the probes start. */
+    memset(&info, 0, sizeof info);
+    strcpy(info.path, s->info[pa->index].path);
+    info.speed = s->info[pa->index].speed;
+    probe(&info);
+
+    pthread_mutex_lock(&s->lock);
+    s->info[pa->index] = info;
+    s->done[pa->index] = 1;
+    s->pending--;
+    pthread_cond_broadcast(&s->cond);
+    pthread_mutex_unlock(&s->lock);
+
+    release(s);
+    return NULL;
+}
+
+
+/* cd_find_drives:
+ *  Look for CD drives, taking no more than MSECS milliseconds (or a
+ *  default if not positive), and fill in up to N of DRIVES.  Return the
+ *  number filled in, or -1 on error.
+ */
+int cd_find_drives(cd_drive_info *drives, int n, int msecs)
+{
+    pthread_attr_t attr;
+    pthread_t thread;
+    struct timespec deadline;
+    Search *s;
+    int i, count;
+
+    s = calloc(1, sizeof(Search));
+    if (!s) {
+	_cd_copy_error();
+	return -1;
+    }
+
+    read_proc_info(s);
+    scan_dev(s);
+    qsort(s->info, s->n, sizeof(cd_drive_info), by_path);
+
+    pthread_mutex_init(&s->lock, NULL);
+    pthread_cond_init(&s->cond, NULL);
+    s->refs = 1;
+
+    if (msecs <= 0)
+	msecs = DEFAULT_PROBE_TIMEOUT;
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_sec += msecs / 1000;
+    deadline.tv_nsec += (msecs % 1000) * 1000000L;
+    if (deadline.tv_nsec >= 1000000000L) {
+	deadline.tv_sec++;
+	deadline.tv_nsec -= 1000000000L;
+    }
+
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+
+    pthread_mutex_lock(&s->lock);
+
+    for (i = 0; i < s->n; i++) {
+	s->arg[i].search = s;
+	s->arg[i].index = i;
+	s->refs++;
+	s->pending++;
+	if (pthread_create(&thread, &attr, prober, &s->arg[i]) != 0) {
+	    s->refs--;
+	    s->pending--;
+	    s->info[i].status = CD_DRIVE_ERROR;
+	    s->done[i] = 1;
+	}
+    }
+
+    while (s->pending > 0)
+	if (pthread_cond_timedwait(&s->cond, &s->lock, &deadline) == ETIMEDOUT)
+	    break;
+
+    for (i = count = 0; (i < s->n) && (count < n); i++) {
+	drives[count] = s->info[i];
+	if (!s->done[i]) {
+	    drives[count].status = CD_DRIVE_TIMEOUT;
+	    drives[count].caps = 0;
+	}
+	count++;
+    }
+
+    pthread_mutex_unlock(&s->lock);
+    pthread_attr_destroy(&attr);
+
+    release(s);
+    return count;
+}
@@ -0,0 +1,474 @@
+/* libcda; emulated drive for the Linux component.
+ *
+ * A drive that exists only in memory, for testing and benchmarking
+ * without hardware.  It is opened with a path like
+ *
+ *	emu:tracks=12,seek=150,speed=4,errors=0.01
+ *
+ * and behaves like a drive holding a disc of audio tracks (each one a
+ * quiet sawtooth), taking as long as a drive would: it spins up after
+ * being idle, seeks when a read or play does not follow on from the
+ * last, transfers at a given speed, and fails reads at random if asked.
+ * Everything is derived from the seed, so runs are repeatable.
+ */
+
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <time.h>
+#include <errno.h>
+#include "cdaint.h"
+
+
+typedef struct {
+    int tracks;
+    int data;			/* last track is data */
+    unsigned long seed;
+    int seek;			/* ms for a seek across the whole disc */
+    int spinup;			/* ms */
+    int spindown;		/* idle ms before it stops spinning */
+    double speed;		/* times 75 frames per second; 0 = no limit */
+    double errors;		/* chance of a read failing */
+    int maxread;		/* most frames per read */
+    int cmd;			/* ms of overhead per command */
+} Options;
+
+
+struct Emu {
+    Options opt;
+    Track tracks[CDROM_LEADOUT + 1];
+    uint64_t rng;
+
+    int head;			/* LBA under the head */
+    double last_access;		/* -1 if not spinning */
+    int ejected, changed;
+    int vol0, vol1;
+    Transport transport;
+};
+
+
+static const Options default_options = {
+    10,		/* tracks */
+    0,		/* data */
+    1,		/* seed */
+    100,	/* seek */
+    1000,	/* spinup */
+    30000,	/* spindown */
+    8,		/* speed */
+    0,		/* errors */
+    64,		/* maxread */
+    0		/* cmd */
+};
+
+
+static double get_secs(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+
+/* random_int:
+ *  xorshift64*, so the same seed gives the same disc and errors.
+ */
+static uint64_t random_int(struct Emu *emu)
+{
+    emu->rng ^= emu->rng >> 12;
+    emu->rng ^= emu->rng << 25;
+    emu->rng ^= emu->rng >> 27;
+    return emu->rng * 2685821657736338717ULL;
+}
+
+
+static double random_real(struct Emu *emu)
+{
+    return (random_int(emu) >> 11) * (1.0 / 9007199254740992.0);
+}
+
+
+/* parse_options:
+ *  Fill in OPT from "key=value,..." in S.  Return zero on success.
+ */
+static int parse_options(Options *opt, const char *s)
+{
+    char key[32];
+    double v;
+    int n;
+
+    *opt = default_options;
+
+    while (*s) {
+	if (sscanf(s, "%31[^=,]=%lf%n", key, &v, &n) != 2) {
+	    _cd_set_error(CDERR_BAD_ARG, "Bad emulator option");
+	    return -1;
+	}
+	s += n;
+	if (*s == ',')
+	    s++;
+
+	if (!strcmp(key, "tracks"))		opt->tracks = MID(1, (int)v, 99);
+	else if (!strcmp(key, "data"))		opt->data = (v != 0);
+	else if (!strcmp(key, "seed"))		opt->seed = (unsigned long)v;
+	else if (!strcmp(key, "seek"))		opt->seek = MAX(0, (int)v);
+	else if (!strcmp(key, "spinup"))	opt->spinup = MAX(0, (int)v);
+	else if (!strcmp(key, "spindown"))	opt->spindown = MAX(0, (int)v);
+	else if (!strcmp(key, "speed"))		opt->speed = MAX(0, v);
+	else if (!strcmp(key, "errors"))	opt->errors = MID(0, v, 1);
+	else if (!strcmp(key, "maxread"))	opt->maxread = MAX(1, (int)v);
+	else if (!strcmp(key, "cmd"))		opt->cmd = MAX(0, (int)v);
+	else {
+	    _cd_set_error(CDERR_BAD_ARG, "Unknown emulator option");
+	    return -1;
+	}
+    }
+
+    return 0;
+}
+
+
+/* make_disc:
+ *  Make up a TOC: tracks of two to six minutes.
+ */
+static void make_disc(struct Emu *emu)
+{
+    int lba = 0, t;
+
+    for (t = 1; t <= emu->opt.tracks; t++) {
+	emu->tracks[t].ctrl = 0;
+	emu->tracks[t].lba = lba;
+	lba += (120 + (int)(random_int(emu) % 240)) * CD_FRAMES;
+    }
+
+    if (emu->opt.data)
+	emu->tracks[emu->opt.tracks].ctrl = CDROM_DATA_TRACK;
+
+    emu->tracks[0].ctrl = CDROM_DATA_TRACK;
+    emu->tracks[0].lba = lba;
+}
+
+
+/* busy:
+ *  Take as long as a command would that must go to LBA (or stay put if
+ *  negative) and then transfer NFRAMES frames.  Return zero, or -1 if
+ *  that would be longer than the timeout.
+ */
+static int busy(cd_device *dev, int lba, int nframes)
+{
+    struct Emu *emu = dev->priv;
+    double now = get_secs(), t = emu->opt.cmd / 1000.0;
+    struct timespec ts;
+    int dist, timed_out;
+
+    if ((emu->last_access < 0) ||
+	(now - emu->last_access > emu->opt.spindown / 1000.0))
+	t += emu->opt.spinup / 1000.0;
+
+    if ((lba >= 0) && (lba != emu->head)) {
+	/* A third of the time is getting going; the rest is distance. */
+	dist = abs(lba - emu->head);
+	t += emu->opt.seek / 1000.0 *
+	    (1 + 2.0 * dist / MAX(1, emu->tracks[0].lba)) / 3;
+	emu->head = lba;
+    }
+
+    if (emu->opt.speed > 0)
+	t += nframes / (emu->opt.speed * CD_FRAMES);
+    emu->head += nframes;
+
+    timed_out = (t > dev->timeout / 1000.0);
+    if (timed_out)
+	t = dev->timeout / 1000.0;
+
+    if (t > 0) {
+	ts.tv_sec = (time_t)t;
+	ts.tv_nsec = (long)((t - ts.tv_sec) * 1e9);
+	while ((nanosleep(&ts, &ts) != 0) && (errno == EINTR))
+	    ;
+    }
+
+    emu->last_access = get_secs();
+
+    if (timed_out) {
+	errno = ETIMEDOUT;
+	_cd_copy_error();
+	return -1;
+    }
+
+    return 0;
+}
+
+
+static int no_disc(void)
+{
+    errno = ENOMEDIUM;
+    _cd_copy_error();
+    return -1;
+}
+
+
+static int emu_open(cd_device *dev, const char *path)
+{
+    struct Emu *emu;
+
+    emu = calloc(1, sizeof(struct Emu));
+    if (!emu) {
+	_cd_copy_error();
+	return -1;
+    }
+
+    if (parse_options(&emu->opt, path + 4) != 0) {
+	free(emu);
+	return -1;
+    }
+
+    emu->rng = emu->opt.seed * 0x9e3779b97f4a7c15ULL + 1;
+    make_disc(emu);
+    emu->last_access = -1;
+    emu->vol0 = emu->vol1 = 255;
+    _cd_transport_stop(&emu->transport);
+    dev->priv = emu;
+    return 0;
+}
+
+
+static void emu_close(cd_device *dev)
+{
+    free(dev->priv);
+}
+
+
+static int emu_read_toc(cd_device *dev)
+{
+    struct Emu *emu = dev->priv;
+
+    if (emu->ejected)
+	return no_disc();
+
+    if (busy(dev, 0, 0) != 0)
+	return -1;
+
+    memcpy(dev->tracks, emu->tracks, sizeof emu->tracks);
+    dev->first_track = 1;
+    dev->last_track = emu->opt.tracks;
+    return 0;
+}
+
+
+static int emu_media_changed(cd_device *dev)
+{
+    struct Emu *emu = dev->priv;
+    int changed = emu->changed || emu->ejected;
+
+    emu->changed = 0;
+    return changed;
+}
+
+
+static int emu_max_read_frames(cd_device *dev)
+{
+    struct Emu *emu = dev->priv;
+
+    return emu->opt.maxread;
+}
+
+
+/* track_of:
+ *  Return the track holding LBA.
+ */
+static int track_of(struct Emu *emu, int lba)
+{
+    int t;
+
+    for (t = emu->opt.tracks; (t > 1) && (emu->tracks[t].lba > lba); t--)
+	;
+
+    return t;
+}
+
+
+static int emu_read_audio(cd_device *dev, int lba, int nframes,
+			  unsigned char *buf)
+{
+    struct Emu *emu = dev->priv;
+    int16_t *p = (int16_t *)buf;
+    unsigned int idx, step = 0;
+    int i;
+
+    if (emu->ejected)
+	return no_disc();
+
+    if (nframes > emu->opt.maxread) {
+	errno = EINVAL;
+	_cd_copy_error();
+	return -1;
+    }
+
+    /* Reading stops playing, as on most drives. */
+    _cd_transport_stop(&emu->transport);
+
+    if (busy(dev, lba, nframes) != 0)
+	return -1;
+
+    if ((emu->opt.errors > 0) && (random_real(emu) < emu->opt.errors)) {
+	errno = EIO;
+	_cd_copy_error();
+	return -1;
+    }
+
+    for (i = 0; i < nframes; i++) {
+	if ((emu->tracks[track_of(emu, lba + i)].ctrl & CDROM_DATA_TRACK) ||
+	    (lba + i >= emu->tracks[0].lba)) {
+	    errno = EIO;
+	    _cd_copy_error();
+	    return -1;
+	}
+    }
+
+    idx = (unsigned int)lba * CD_FRAME_SAMPLES;
+    for (i = 0; i < nframes * CD_FRAME_SAMPLES; i++, idx++) {
+	if (i % CD_FRAME_SAMPLES == 0)
+	    step = 64 * track_of(emu, lba + i / CD_FRAME_SAMPLES);
+	p[2*i] = (int16_t)(((idx * step) & 0xffff) - 0x8000) >> 3;
+	p[2*i+1] = -p[2*i];
+    }
+
+    return 0;
+}
+
+
+static int emu_play(cd_device *dev, int lba0, int lba1)
+{
+    struct Emu *emu = dev->priv;
+
+    if (emu->ejected)
+	return no_disc();
+
+    if (busy(dev, lba0, 0) != 0)
+	return -1;
+
+    _cd_transport_play(&emu->transport, lba0, lba1);
+    return 0;
+}
+
+
+static int emu_pause(cd_device *dev)
+{
+    struct Emu *emu = dev->priv;
+
+    if (busy(dev, -1, 0) != 0)
+	return -1;
+
+    _cd_transport_pause(&emu->transport);
+    return 0;
+}
+
+
+static int emu_resume(cd_device *dev)
+{
+    struct Emu *emu = dev->priv;
+
+    if (busy(dev, -1, 0) != 0)
+	return -1;
+
+    _cd_transport_resume(&emu->transport);
+    return 0;
+}
+
+
+static int emu_stop(cd_device *dev)
+{
+    struct Emu *emu = dev->priv;
+
+    if (busy(dev, -1, 0) != 0)
+	return -1;
+
+    _cd_transport_stop(&emu->transport);
+    return 0;
+}
+
+
+static int emu_get_subchnl(cd_device *dev, Subchnl *s)
+{
+    struct Emu *emu = dev->priv;
+
+    if (emu->ejected)
+	return no_disc();
+
+    _cd_transport_subchnl(dev, &emu->transport, s);
+
+    /* Playing keeps the disc spinning. */
+    if (s->audiostatus == CDROM_AUDIO_PLAY) {
+	emu->head = s->abs_lba;
+	emu->last_access = get_secs();
+    }
+
+    return 0;
+}
+
+
+static int emu_get_volume(cd_device *dev, int *c0, int *c1)
+{
+    struct Emu *emu = dev->priv;
+
+    *c0 = emu->vol0;
+    *c1 = emu->vol1;
+    return 0;
+}
+
+
+static int emu_set_volume(cd_device *dev, int c0, int c1)
+{
+    struct Emu *emu = dev->priv;
+
+    emu->vol0 = c0;
+    emu->vol1 = c1;
+    return 0;
+}
+
+
+static int emu_eject(cd_device *dev)
+{
+    struct Emu *emu = dev->priv;
+
+    emu->ejected = 1;
+    emu->last_access = -1;
+    _cd_transport_stop(&emu->transport);
+    return 0;
+}
+
+
+static int emu_close_tray(cd_device *dev)
+{
+    struct Emu *emu = dev->priv;
+
+    if (emu->ejected) {
+	emu->ejected = 0;
+	emu->changed = 1;
+    }
+
+    return 0;
+}
+
+
+const Driver _cd_driver_emu = {
+    "emu",
+    emu_open,
+    emu_close,
+    emu_read_toc,
+    emu_media_changed,
+    emu_max_read_frames,
+    emu_read_audio,
+    emu_play,
+    emu_pause,
+    emu_resume,
+    emu_stop,
+    emu_get_subchnl,
+    emu_get_volume,
+    emu_set_volume,
+    emu_eject,
+    emu_close_tray,
+    NULL,
+    NULL
+};
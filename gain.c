@@ -0,0 +1,199 @@
+/* libcda; software volume for the Linux component.
+ *
+ * cd_set_volume only reaches the drive's analogue output, which has no
+ * effect on extracted audio.  So the volume is also kept per drive and
+ * applied to samples as streams hand them over.  This happens at the
+ * consumer end, so a change is heard at once however much has been
+ * read ahead.
+ *
+ * A change of volume is ramped in over a frame to avoid clicks.  At a
+ * steady volume the samples are scaled with SSE2 or AVX2 where the CPU
+ * has them, and at full volume they are not touched at all.
+ */
+
+#include <stdint.h>
+#include "cdaint.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define HAVE_X86_SIMD
+#endif
+
+
+/* Gains are 2.14 fixed point, so full volume is exactly one. */
+#define UNITY		16384
+
+/* Most a gain changes per sample: full scale over one frame. */
+#define RAMP_STEP	((UNITY + CD_FRAME_SAMPLES - 1) / CD_FRAME_SAMPLES)
+
+
+/* Kernels scale N stereo samples at P by G0 (left) and G1 (right). */
+typedef void (*SCALE)(int16_t *p, int n, int g0, int g1);
+
+
+static void scale_c(int16_t *p, int n, int g0, int g1)
+{
+    int i;
+
+    for (i = 0; i < n; i++) {
+	p[2*i]   = (p[2*i]   * g0) >> 14;
+	p[2*i+1] = (p[2*i+1] * g1) >> 14;
+    }
+}
+
+
+/* Floating point samples are only made by the resampler, which costs
+ * far more than this, so there is no SIMD version. */
+static void scale_f32(float *p, int n, int g0, int g1)
+{
+    float f0 = g0 * (1.0f / UNITY), f1 = g1 * (1.0f / UNITY);
+    int i;
+
+    for (i = 0; i < n; i++) {
+	p[2*i]   *= f0;
+	p[2*i+1] *= f1;
+    }
+}
+
+
+#ifdef HAVE_X86_SIMD
+
+__attribute__((target("sse2")))
+static void scale_sse2(int16_t *p, int n, int g0, int g1)
+{
+    __m128i g = _mm_set1_epi32((g1 << 16) | g0);
+    __m128i x, lo, hi;
+    int i;
+
+    for (i = 0; i + 4 <= n; i += 4) {
+	x = _mm_loadu_si128((__m128i *)(p + 2*i));
+	lo = _mm_mullo_epi16(x, g);
+	hi = _mm_mulhi_epi16(x, g);
+	x = _mm_packs_epi32(_mm_srai_epi32(_mm_unpacklo_epi16(lo, hi), 14),
+			    _mm_srai_epi32(_mm_unpackhi_epi16(lo, hi), 14));
+	_mm_storeu_si128((__m128i *)(p + 2*i), x);
+    }
+
+    scale_c(p + 2*i, n - i, g0, g1);
+}
+
+
+__attribute__((target("avx2")))
+static void scale_avx2(int16_t *p, int n, int g0, int g1)
+{
+    __m256i g = _mm256_set1_epi32((g1 << 16) | g0);
+    __m256i x, lo, hi;
+    int i;
+
+    /* The unpacks and pack work within 128-bit lanes, so they undo
+     * each other and the samples stay in order. */
+    for (i = 0; i + 8 <= n; i += 8) {
+	x = _mm256_loadu_si256((__m256i *)(p + 2*i));
+	lo = _mm256_mullo_epi16(x, g);
+	hi = _mm256_mulhi_epi16(x, g);
+	x = _mm256_packs_epi32(
+		_mm256_srai_epi32(_mm256_unpacklo_epi16(lo, hi), 14),
+		_mm256_srai_epi32(_mm256_unpackhi_epi16(lo, hi), 14));
+	_mm256_storeu_si256((__m256i *)(p + 2*i), x);
+    }
+
+    scale_c(p + 2*i, n - i, g0, g1);
+}
+
+#endif
+
+
+static SCALE scale;
+static pthread_once_t scale_once = PTHREAD_ONCE_INIT;
+
+
+static void choose_scale(void)
+{
+    scale = scale_c;
+
+#ifdef HAVE_X86_SIMD
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2"))
+	scale = scale_avx2;
+    else if (__builtin_cpu_supports("sse2"))
+	scale = scale_sse2;
+#endif
+}
+
+
+/* to_gain:
+ *  Convert a volume (0 - 255) to a gain.
+ */
+static int to_gain(int vol)
+{
+    return (vol * UNITY + 127) / 255;
+}
+
+
+/* target_gains:
+ *  Return the gains the volume of DEV asks for in G.
+ */
+static void target_gains(cd_device *dev, int *g)
+{
+    int vol = __atomic_load_n(&dev->volume, __ATOMIC_RELAXED);
+
+    g[0] = to_gain(vol & 0xff);
+    g[1] = to_gain((vol >> 8) & 0xff);
+}
+
+
+/* step:
+ *  Move gain G one step towards TARGET.
+ */
+static int step(int g, int target)
+{
+    if (g < target)
+	return MIN(g + RAMP_STEP, target);
+    else
+	return MAX(g - RAMP_STEP, target);
+}
+
+
+/* _cd_gain_init:
+ *  Start S off at the current volume of its drive, without a ramp.
+ */
+void _cd_gain_init(cd_stream *s)
+{
+    pthread_once(&scale_once, choose_scale);
+    target_gains(s->dev, s->gain);
+}
+
+
+/* _cd_apply_gain:
+ *  Apply the volume of the drive to N samples of S at BUF, which are in
+ *  FORMAT.  Never blocks, so it may be called from cd_stream_pull.
+ */
+void _cd_apply_gain(cd_stream *s, void *buf, int n, int format)
+{
+    int16_t *p = buf;
+    float *f = buf;
+    int target[2];
+
+    target_gains(s->dev, target);
+
+    while ((n > 0) &&
+	   ((s->gain[0] != target[0]) || (s->gain[1] != target[1]))) {
+	s->gain[0] = step(s->gain[0], target[0]);
+	s->gain[1] = step(s->gain[1], target[1]);
+	if (format == CD_FORMAT_F32)
+	    scale_f32(f, 1, s->gain[0], s->gain[1]);
+	else
+	    scale_c(p, 1, s->gain[0], s->gain[1]);
+	p += 2;
+	f += 2;
+	n--;
+    }
+
+    if ((n <= 0) || ((s->gain[0] == UNITY) && (s->gain[1] == UNITY)))
+	return;
+
+    if (format == CD_FORMAT_F32)
+	scale_f32(f, n, s->gain[0], s->gain[1]);
+    else
+	scale(p, n, s->gain[0], s->gain[1]);
+}
@@ -0,0 +1,675 @@
+/* libcda; disc image driver for the Linux component.
+ *
+ * Serves a CUE sheet and its BIN files as if they were a disc in a
+ * drive, for machines without one.  The BIN files are mapped into
+ * memory, so audio is read at the speed of the disk (or the page
+ * cache) and cd_map_audio can hand out the frames without copying.
+ *
+ * Playing is emulated with a clock: the position is worked out from
+ * when play started, at 75 frames per second.  Nothing is heard.
+ */
+
+#include <string.h>
+#include <strings.h>
+#include <stdlib.h>
+#include <limits.h>
+#include <stdio.h>
+#include <ctype.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "cdaint.h"
+
+
+#define MAX_BINS	CDROM_LEADOUT
+#define MAX_SEGMENTS	(2 * 99)
+
+/* Claimed by max_read_frames; reads are only memcpy. */
+#define MAX_READ_FRAMES	1024
+
+
+typedef struct {
+    unsigned char *data;
+    size_t size;
+    int swap;			/* MOTOROLA: big-endian samples */
+} Bin;
+
+
+/* A run of frames on the disc, from one BIN file or (BIN < 0) silence
+ * for a PREGAP.
+ */
+typedef struct {
+    int lba, nframes;
+    int bin;
+    size_t offset;
+    int sector;			/* bytes per frame in the file */
+} Segment;
+
+
+struct Image {
+    int nbins;
+    Bin bins[MAX_BINS];
+    int nsegs;
+    Segment segs[MAX_SEGMENTS];
+
+    int first, last;
+    Track tracks[CDROM_LEADOUT + 1];
+
+    int ejected, changed;
+    int vol0, vol1;
+
+    Transport transport;
+};
+
+
+/* What the parser collects for each track. */
+typedef struct {
+    int bin;
+    int sector, ctrl;
+    int pregap;
+    int index0, index1;		/* frames from start of BIN, or -1 */
+} CueTrack;
+
+
+/* parse_msf:
+ *  Convert "mm:ss:ff" to frames.  Return -1 if it isn't one.
+ */
+static int parse_msf(const char *s)
+{
+    int m, sec, f;
+
+    if ((!s) || (sscanf(s, "%d:%d:%d", &m, &sec, &f) != 3) ||
+	(sec >= CD_SECS) || (f >= CD_FRAMES))
+	return -1;
+
+    return (m * CD_SECS + sec) * CD_FRAMES + f;
+}
+
+
+/* next_token:
+ *  Return the next word of the line at *P, which may be in double
+ *  quotes, and move past it.  Return NULL at the end of the line.
+ */
+static char *next_token(char **p)
+{
+    char *s = *p, *start;
+
+    while (isspace((unsigned char)*s))
+	s++;
+    if (!*s)
+	return NULL;
+
+    if (*s == '"') {
+	start = ++s;
+	while (*s && (*s != '"'))
+	    s++;
+    }
+    else {
+	start = s;
+	while (*s && !isspace((unsigned char)*s))
+	    s++;
+    }
+
+    if (*s)
+	*s++ = 0;
+    *p = s;
+    return start;
+}
+
+
+/* track_type:
+ *  Set the sector size and control bits for a TRACK of TYPE.  Return
+ *  zero if we know the type.
+ */
+static int track_type(const char *type, CueTrack *t)
+{
+    static const struct { const char *name; int sector; } types[] = {
+	{ "AUDIO",	CD_FRAMESIZE_RAW },
+	{ "CDG",	CD_FRAMESIZE_RAW + 96 },
+	{ "MODE1/2048",	CD_FRAMESIZE },
+	{ "MODE1/2352",	CD_FRAMESIZE_RAW },
+	{ "MODE2/2336",	CD_FRAMESIZE_RAW0 },
+	{ "MODE2/2352",	CD_FRAMESIZE_RAW },
+	{ NULL, 0 }
+    };
+    int i;
+
+    for (i = 0; types[i].name; i++) {
+	if (strcasecmp(type, types[i].name) == 0) {
+	    t->sector = types[i].sector;
+	    t->ctrl = (i < 2) ? 0 : CDROM_DATA_TRACK;
+	    return 0;
+	}
+    }
+
+    return -1;
+}
+
+
+/* map_bin:
+ *  Map the file NAME, relative to the directory of the cue sheet at
+ *  CUE, into IMG.  Return zero on success.
+ */
+static int map_bin(struct Image *img, const char *cue, const char *name,
+		   int swap)
+{
+    char path[PATH_MAX];
+    const char *slash = strrchr(cue, '/');
+    struct stat st;
+    Bin *b;
+    int fd;
+
+    if ((name[0] == '/') || (!slash))
+	snprintf(path, sizeof path, "%s", name);
+    else
+	snprintf(path, sizeof path, "%.*s/%s", (int)(slash - cue), cue, name);
+
+    if (img->nbins == MAX_BINS) {
+	_cd_set_error(CDERR_UNSUPPORTED, "Too many files in cue sheet");
+	return -1;
+    }
+
+    fd = open(path, O_RDONLY);
+    if ((fd < 0) || (fstat(fd, &st) != 0)) {
+	_cd_copy_error();
+	if (fd >= 0)
+	    close(fd);
+	return -1;
+    }
+
+    b = &img->bins[img->nbins];
+    b->size = st.st_size;
+    b->swap = swap;
+    b->data = (b->size > 0) ?
+	mmap(NULL, b->size, PROT_READ, MAP_SHARED, fd, 0) : NULL;
+    close(fd);
+
+    if (b->data == MAP_FAILED) {
+	_cd_copy_error();
+	return -1;
+    }
+
+    if (b->data)
+	madvise(b->data, b->size, MADV_SEQUENTIAL);
+
+    img->nbins++;
+    return 0;
+}
+
+
+/* add_segment:
+ *  Append a run of NFRAMES frames to IMG.
+ */
+static int add_segment(struct Image *img, int lba, int nframes, int bin,
+		       size_t offset, int sector)
+{
+    Segment *seg;
+
+    if (nframes <= 0)
+	return 0;
+
+    if (img->nsegs == MAX_SEGMENTS) {
+	_cd_set_error(CDERR_UNSUPPORTED, "Cue sheet too complicated");
+	return -1;
+    }
+
+    seg = &img->segs[img->nsegs++];
+    seg->lba = lba;
+    seg->nframes = nframes;
+    seg->bin = bin;
+    seg->offset = offset;
+    seg->sector = sector;
+    return 0;
+}
+
+
+/* lay_out:
+ *  Place the NTRACKS tracks in CT, numbered from FIRST, on the disc:
+ *  work out the TOC and which file each frame comes from.
+ */
+static int lay_out(struct Image *img, CueTrack *ct, int ntracks, int first)
+{
+    size_t offset = 0;
+    int lba = 0, i, start, end, n;
+
+    for (i = 0; i < ntracks; i++) {
+	CueTrack *t = &ct[i], *next = (i + 1 < ntracks) ? &ct[i + 1] : NULL;
+	Bin *b = &img->bins[t->bin];
+
+	if (t->index1 < 0) {
+	    _cd_set_error(CDERR_IO, "Track without INDEX 01 in cue sheet");
+	    return -1;
+	}
+
+	/* A track's frames in the file start at INDEX 00 if it has one,
+	 * and run up to where the next track starts in the same file. */
+	start = (t->index0 >= 0) ? t->index0 : t->index1;
+	if ((i == 0) || (ct[i - 1].bin != t->bin))
+	    offset = (size_t)start * t->sector;
+
+	if (next && (next->bin == t->bin))
+	    end = (next->index0 >= 0) ? next->index0 : next->index1;
+	else
+	    end = start + (int)((b->size - MIN(offset, b->size)) / t->sector);
+
+	if (add_segment(img, lba, t->pregap, -1, 0, CD_FRAMESIZE_RAW) != 0)
+	    return -1;
+	lba += t->pregap;
+
+	img->tracks[first + i].ctrl = t->ctrl;
+	img->tracks[first + i].lba = lba + (t->index1 - start);
+
+	n = end - start;
+	if (offset + (size_t)n * t->sector > b->size) {
+	    _cd_set_error(CDERR_IO, "Cue sheet runs past end of file");
+	    return -1;
+	}
+	if (add_segment(img, lba, n, t->bin, offset, t->sector) != 0)
+	    return -1;
+
+	lba += n;
+	offset += (size_t)n * t->sector;
+    }
+
+    img->first = first;
+    img->last = first + ntracks - 1;
+    img->tracks[0].ctrl = CDROM_DATA_TRACK;
+    img->tracks[0].lba = lba;
+    return 0;
+}
+
+
+/* parse_cue:
+ *  Read the cue sheet at PATH into IMG.  Return zero on success.
+ */
+static int parse_cue(struct Image *img, const char *path)
+{
+    CueTrack ct[99];
+    char line[1024], *p, *cmd, *arg, *type;
+    int ntracks = 0, first = 0, bin = -1, num, ret = -1;
+    FILE *f;
+
+    f = fopen(path, "r");
+    if (!f) {
+	_cd_copy_error();
+	return -1;
+    }
+
+    while (fgets(line, sizeof line, f)) {
+	p = line;
+	cmd = next_token(&p);
+	if (!cmd)
+	    continue;
+
+	if (strcasecmp(cmd, "FILE") == 0) {
+	    arg = next_token(&p);
+	    type = next_token(&p);
+	    if ((!arg) ||
+		(map_bin(img, path, arg, type && !strcasecmp(type, "MOTOROLA")) != 0))
+		goto done;
+	    bin = img->nbins - 1;
+	}
+	else if (strcasecmp(cmd, "TRACK") == 0) {
+	    arg = next_token(&p);
+	    type = next_token(&p);
+	    num = arg ? atoi(arg) : 0;
+	    if ((bin < 0) || (ntracks == 99) || (!type) ||
+		(num < 1) || (num > 99) || (ntracks && (num != first + ntracks))) {
+		_cd_set_error(CDERR_IO, "Bad TRACK in cue sheet");
+		goto done;
+	    }
+	    if (ntracks == 0)
+		first = num;
+	    memset(&ct[ntracks], 0, sizeof(CueTrack));
+	    ct[ntracks].bin = bin;
+	    ct[ntracks].index0 = ct[ntracks].index1 = -1;
+	    if (track_type(type, &ct[ntracks]) != 0) {
+		_cd_set_error(CDERR_UNSUPPORTED, "Unknown track type in cue sheet");
+		goto done;
+	    }
+	    ntracks++;
+	}
+	else if ((strcasecmp(cmd, "INDEX") == 0) && (ntracks > 0)) {
+	    arg = next_token(&p);
+	    num = arg ? atoi(arg) : -1;
+	    if (num == 0)
+		ct[ntracks - 1].index0 = parse_msf(next_token(&p));
+	    else if (num == 1)
+		ct[ntracks - 1].index1 = parse_msf(next_token(&p));
+	}
+	else if ((strcasecmp(cmd, "PREGAP") == 0) && (ntracks > 0)) {
+	    num = parse_msf(next_token(&p));
+	    ct[ntracks - 1].pregap = MAX(0, num);
+	}
+	else if ((strcasecmp(cmd, "FLAGS") == 0) && (ntracks > 0)) {
+	    while ((arg = next_token(&p))) {
+		if (strcasecmp(arg, "PRE") == 0)
+		    ct[ntracks - 1].ctrl |= 0x01;
+		else if (strcasecmp(arg, "DCP") == 0)
+		    ct[ntracks - 1].ctrl |= 0x02;
+		else if (strcasecmp(arg, "4CH") == 0)
+		    ct[ntracks - 1].ctrl |= 0x08;
+	    }
+	}
+	/* REM, TITLE, PERFORMER, CATALOG etc. don't matter to us. */
+    }
+
+    if (ntracks == 0)
+	_cd_set_error(CDERR_IO, "No tracks in cue sheet");
+    else
+	ret = lay_out(img, ct, ntracks, first);
+
+  done:
+
+    fclose(f);
+    return ret;
+}
+
+
+static void unmap_bins(struct Image *img)
+{
+    int i;
+
+    for (i = 0; i < img->nbins; i++)
+	if (img->bins[i].data)
+	    munmap(img->bins[i].data, img->bins[i].size);
+}
+
+
+static int img_open(cd_device *dev, const char *path)
+{
+    struct Image *img;
+
+    img = calloc(1, sizeof(struct Image));
+    if (!img) {
+	_cd_copy_error();
+	return -1;
+    }
+
+    if (parse_cue(img, path) != 0) {
+	unmap_bins(img);
+	free(img);
+	return -1;
+    }
+
+    img->vol0 = img->vol1 = 255;
+    _cd_transport_stop(&img->transport);
+    dev->priv = img;
+    return 0;
+}
+
+
+static void img_close(cd_device *dev)
+{
+    struct Image *img = dev->priv;
+
+    unmap_bins(img);
+    free(img);
+}
+
+
+static int no_disc(void)
+{
+    errno = ENOMEDIUM;
+    _cd_copy_error();
+    return -1;
+}
+
+
+static int img_read_toc(cd_device *dev)
+{
+    struct Image *img = dev->priv;
+
+    if (img->ejected)
+	return no_disc();
+
+    memcpy(dev->tracks, img->tracks, sizeof img->tracks);
+    dev->first_track = img->first;
+    dev->last_track = img->last;
+    return 0;
+}
+
+
+static int img_media_changed(cd_device *dev)
+{
+    struct Image *img = dev->priv;
+    int changed = img->changed || img->ejected;
+
+    img->changed = 0;
+    return changed;
+}
+
+
+static int img_max_read_frames(cd_device *dev)
+{
+    (void)dev;
+    return MAX_READ_FRAMES;
+}
+
+
+/* find_segment:
+ *  Return the segment holding LBA, or NULL.
+ */
+static Segment *find_segment(struct Image *img, int lba)
+{
+    int lo = 0, hi = img->nsegs - 1, mid;
+
+    while (lo <= hi) {
+	mid = (lo + hi) / 2;
+	if (lba < img->segs[mid].lba)
+	    hi = mid - 1;
+	else if (lba >= img->segs[mid].lba + img->segs[mid].nframes)
+	    lo = mid + 1;
+	else
+	    return &img->segs[mid];
+    }
+
+    return NULL;
+}
+
+
+static void copy_frame(unsigned char *dst, const unsigned char *src,
+		       int swap)
+{
+    int i;
+
+    if (!swap)
+	memcpy(dst, src, CD_FRAMESIZE_RAW);
+    else {
+	for (i = 0; i < CD_FRAMESIZE_RAW; i += 2) {
+	    dst[i] = src[i + 1];
+	    dst[i + 1] = src[i];
+	}
+    }
+}
+
+
+static int img_read_audio(cd_device *dev, int lba, int nframes,
+			  unsigned char *buf)
+{
+    struct Image *img = dev->priv;
+    const unsigned char *src;
+    Segment *seg;
+    Bin *b;
+    int n, i;
+
+    if (img->ejected)
+	return no_disc();
+
+    while (nframes > 0) {
+	seg = find_segment(img, lba);
+	if (!seg) {
+	    errno = EIO;
+	    _cd_copy_error();
+	    return -1;
+	}
+
+	n = MIN(nframes, seg->lba + seg->nframes - lba);
+	b = (seg->bin >= 0) ? &img->bins[seg->bin] : NULL;
+
+	if ((!b) || (seg->sector < CD_FRAMESIZE_RAW)) {
+	    /* Silence, or a cooked data track. */
+	    memset(buf, 0, n * CD_FRAMESIZE_RAW);
+	}
+	else {
+	    src = b->data + seg->offset + (size_t)(lba - seg->lba) * seg->sector;
+	    if ((!b->swap) && (seg->sector == CD_FRAMESIZE_RAW))
+		memcpy(buf, src, n * CD_FRAMESIZE_RAW);
+	    else {
+		/* Byte swapping, or skipping CD+G subcode. */
+		for (i = 0; i < n; i++) {
+		    copy_frame(buf + i * CD_FRAMESIZE_RAW, src, b->swap);
+		    src += seg->sector;
+		}
+	    }
+	}
+
+	lba += n;
+	nframes -= n;
+	buf += n * CD_FRAMESIZE_RAW;
+    }
+
+    return 0;
+}
+
+
+static const void *img_map_audio(cd_device *dev, int lba, int nframes)
+{
+    struct Image *img = dev->priv;
+    Segment *seg;
+    Bin *b;
+
+    if (img->ejected) {
+	no_disc();
+	return NULL;
+    }
+
+    seg = find_segment(img, lba);
+    if ((!seg) || (seg->bin < 0) || (seg->sector != CD_FRAMESIZE_RAW) ||
+	(img->bins[seg->bin].swap) ||
+	(lba + nframes > seg->lba + seg->nframes)) {
+	_cd_set_error(CDERR_UNSUPPORTED, "Frames not contiguous in image");
+	return NULL;
+    }
+
+    b = &img->bins[seg->bin];
+    return b->data + seg->offset + (size_t)(lba - seg->lba) * seg->sector;
+}
+
+
+static int img_play(cd_device *dev, int lba0, int lba1)
+{
+    struct Image *img = dev->priv;
+
+    if (img->ejected)
+	return no_disc();
+
+    _cd_transport_play(&img->transport, lba0, lba1);
+    return 0;
+}
+
+
+static int img_pause(cd_device *dev)
+{
+    struct Image *img = dev->priv;
+
+    _cd_transport_pause(&img->transport);
+    return 0;
+}
+
+
+static int img_resume(cd_device *dev)
+{
+    struct Image *img = dev->priv;
+
+    _cd_transport_resume(&img->transport);
+    return 0;
+}
+
+
+static int img_stop(cd_device *dev)
+{
+    struct Image *img = dev->priv;
+
+    _cd_transport_stop(&img->transport);
+    return 0;
+}
+
+
+static int img_get_subchnl(cd_device *dev, Subchnl *s)
+{
+    struct Image *img = dev->priv;
+
+    if (img->ejected)
+	return no_disc();
+
+    _cd_transport_subchnl(dev, &img->transport, s);
+    return 0;
+}
+
+
+static int img_get_volume(cd_device *dev, int *c0, int *c1)
+{
+    struct Image *img = dev->priv;
+
+    *c0 = img->vol0;
+    *c1 = img->vol1;
+    return 0;
+}
+
+
+static int img_set_volume(cd_device *dev, int c0, int c1)
+{
+    struct Image *img = dev->priv;
+
+    img->vol0 = c0;
+    img->vol1 = c1;
+    return 0;
+}
+
+
+static int img_eject(cd_device *dev)
+{
+    struct Image *img = dev->priv;
+
+    img->ejected = 1;
+    _cd_transport_stop(&img->transport);
+    return 0;
+}
+
+
+static int img_close_tray(cd_device *dev)
+{
+    struct Image *img = dev->priv;
+
+    if (img->ejected) {
+	img->ejected = 0;
+	img->changed = 1;
+    }
+
+    return 0;
+}
+
+
+const Driver _cd_driver_image = {
+    "image",
+    img_open,
+    img_close,
+    img_read_toc,
+    img_media_changed,
+    img_max_read_frames,
+    img_read_audio,
+    img_play,
+    img_pause,
+    img_resume,
+    img_stop,
+    img_get_subchnl,
+    img_get_volume,
+    img_set_volume,
+    img_eject,
+    img_close_tray,
+    img_map_audio,
+    NULL
+};
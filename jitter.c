@@ -0,0 +1,368 @@
+/* libcda; jitter correction for the Linux component.
+ *
+ * Cheap drives don't always start a read exactly where they were asked
+ * to, so consecutive reads may overlap or leave a gap of a few samples.
+ * With jitter correction on, each batch is read starting a frame early.
+ * The last samples we delivered are searched for in that overlap, and
+ * the batch is delivered from wherever they end.  If they can't be
+ * found, only the overlap and the frame after it are read again.  Once
+ * those line up, the start of that frame is searched for in the batch
+ * (anywhere it could be, not just as far as a drive drifts), and the
+ * batch delivered from there.  If it isn't found the batch itself is
+ * bad, so just the frame that was read again is delivered.
+ *
+ * The search is the expensive part, so it uses SSE2 or AVX2 where the
+ * CPU has them.
+ */
+
+#include <string.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include "cdaint.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define HAVE_X86_SIMD
+#endif
+
+
+/* Samples compared, and furthest a read may be out by (in samples). */
+#define WINDOW		(CD_FRAME_SAMPLES / 2)
+#define MAX_SHIFT	(JITTER_OVERLAP * CD_FRAME_SAMPLES - WINDOW)
+
+/* Most frames delivered per batch. */
+#define MAX_FRAMES	CD_FRAMES
+
+/* Frames read again when a batch doesn't line up. */
+#define REREAD_FRAMES	(JITTER_OVERLAP + 1 + JITTER_TAIL)
+
+#define MAX_REREADS	3
+
+
+struct Jitter {
+    uint32_t tail[WINDOW];	/* last samples delivered */
+    int next_lba;		/* LBA following them, or -1 */
+    uint32_t *scratch;
+    uint32_t reread[REREAD_FRAMES * CD_FRAME_SAMPLES];
+    int shifted, rereads, failed;
+};
+
+
+/* Searches return the position P in [LO, HI] closest to CENTER for
+ * which HAY[P..P+WINDOW) equals WIN, or -1.
+ */
+typedef int (*SEARCH)(const uint32_t *win, const uint32_t *hay,
+		      int lo, int hi, int center);
+
+
+static int closer(int p, int best, int center)
+{
+    return (best < 0) || (abs(p - center) < abs(best - center));
+}
+
+
+static int search_c(const uint32_t *win, const uint32_t *hay,
+		    int lo, int hi, int center)
+{
+    int p, best = -1;
+
+    for (p = lo; p <= hi; p++) {
+	if ((hay[p] == win[0]) &&
+	    (memcmp(hay + p, win, WINDOW * sizeof(uint32_t)) == 0) &&
+	    closer(p, best, center))
+	    best = p;
+    }
+
+    return best;
+}
+
+
+#ifdef HAVE_X86_SIMD
+
+__attribute__((target("sse2")))
+static int equal_sse2(const uint32_t *a, const uint32_t *b, int n)
+{
+    __m128i x, y;
+    int i;
+
+    for (i = 0; i + 4 <= n; i += 4) {
+	x = _mm_loadu_si128((const __m128i *)(a + i));
+	y = _mm_loadu_si128((const __m128i *)(b + i));
+	if (_mm_movemask_epi8(_mm_cmpeq_epi32(x, y)) != 0xffff)
+	    return 0;
+    }
+
+    for (; i < n; i++)
+	if (a[i] != b[i])
+	    return 0;
+
+    return 1;
+}
+
+
+__attribute__((target("sse2")))
+static int search_sse2(const uint32_t *win, const uint32_t *hay,
+		       int lo, int hi, int center)
+{
+    __m128i first = _mm_set1_epi32(win[0]);
+    int p, mask, best = -1;
+
+    for (p = lo; p <= hi; p += 4) {
+	mask = _mm_movemask_ps(_mm_castsi128_ps(_mm_cmpeq_epi32(first,
+		    _mm_loadu_si128((const __m128i *)(hay + p)))));
+	if (hi - p < 3)
+	    mask &= (1 << (hi - p + 1)) - 1;
+
+	while (mask) {
+	    int q = p + __builtin_ctz(mask);
+	    mask &= mask - 1;
+	    if (closer(q, best, center) && equal_sse2(hay + q, win, WINDOW))
+		best = q;
+	}
+    }
+
+    return best;
+}
+
+
+__attribute__((target("avx2")))
+static int equal_avx2(const uint32_t *a, const uint32_t *b, int n)
+{
+    __m256i x, y;
+    int i;
+
+    for (i = 0; i + 8 <= n; i += 8) {
+	x = _mm256_loadu_si256((const __m256i *)(a + i));
+	y = _mm256_loadu_si256((const __m256i *)(b + i));
+	if (_mm256_movemask_epi8(_mm256_cmpeq_epi32(x, y)) != -1)
+	    return 0;
+    }
+
+    for (; i < n; i++)
+	if (a[i] != b[i])
+	    return 0;
+
+    return 1;
+}
+
+
+__attribute__((target("avx2")))
+static int search_avx2(const uint32_t *win, const uint32_t *hay,
+		       int lo, int hi, int center)
+{
+    __m256i first = _mm256_set1_epi32(win[0]);
+    int p, mask, best = -1;
+
+    for (p = lo; p <= hi; p += 8) {
+	mask = _mm256_movemask_ps(_mm256_castsi256_ps(_mm256_cmpeq_epi32(first,
+		    _mm256_loadu_si256((const __m256i *)(hay + p)))));
+	if (hi - p < 7)
+	    mask &= (1 << (hi - p + 1)) - 1;
+
+	while (mask) {
+	    int q = p + __builtin_ctz(mask);
+	    mask &= mask - 1;
+	    if (closer(q, best, center) && equal_avx2(hay + q, win, WINDOW))
+		best = q;
+	}
+    }
+
+    return best;
+}
+
+#endif
+
+
+static SEARCH search;
+static pthread_once_t search_once = PTHREAD_ONCE_INIT;
+
+
+static void choose_search(void)
+{
+    search = search_c;
+
+#ifdef HAVE_X86_SIMD
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2"))
+	search = search_avx2;
+    else if (__builtin_cpu_supports("sse2"))
+	search = search_sse2;
+#endif
+}
+
+
+/* remember:
+ *  Keep the end of NFRAMES frames just delivered in BUF, from LBA.
+ */
+static void remember(struct Jitter *j, unsigned char *buf, int nframes,
+		     int lba)
+{
+    memcpy(j->tail, buf + nframes * CD_FRAMESIZE_RAW - sizeof j->tail,
+	   sizeof j->tail);
+    j->next_lba = lba + nframes;
+}
+
+
+/* read_span:
+ *  Read exactly NFRAMES frames at LBA into BUF.  Return zero on success.
+ */
+static int read_span(cd_device *dev, int lba, int nframes, uint32_t *buf)
+{
+    unsigned char *p = (unsigned char *)buf;
+    int n;
+
+    while (nframes > 0) {
+	n = _cd_read_batch(dev, lba, nframes, p);
+	if (n < 0)
+	    return -1;
+	lba += n;
+	nframes -= n;
+	p += n * CD_FRAMESIZE_RAW;
+    }
+
+    return 0;
+}
+
+
+/* _cd_jitter_read:
+ *  Like _cd_read_batch, but lining the frames up with the ones delivered
+ *  last time, if LBA follows on from them.
+ */
+int _cd_jitter_read(cd_device *dev, int lba, int nframes, unsigned char *buf)
+{
+    struct Jitter *j = dev->jitter;
+    int want, tail, rtail, base, hi, start, p, tries;
+
+    if (lba != j->next_lba) {
+	want = _cd_read_batch(dev, lba, nframes, buf);
+	if (want > 0)
+	    remember(j, buf, want, lba);
+	return want;
+    }
+
+    want = MIN(nframes, MAX_FRAMES);
+    want = MIN(want, MAX(1, dev->batch - JITTER_OVERLAP - JITTER_TAIL));
+    tail = MIN(JITTER_TAIL, dev->tracks[0].lba - (lba + want));
+
+    /* Where the remembered samples should be, and the furthest right
+     * we can look for them without running off the end. */
+    base = JITTER_OVERLAP * CD_FRAME_SAMPLES - WINDOW;
+    hi = base + MIN(MAX_SHIFT, tail * CD_FRAME_SAMPLES);
+
+    if (read_span(dev, lba - JITTER_OVERLAP, JITTER_OVERLAP + want + tail,
+		  j->scratch) != 0)
+	return -1;
+
+    /* START is where the batch follows on from the remembered samples. */
+    p = search(j->tail, j->scratch, base - MAX_SHIFT, hi, base);
+    start = (p >= 0) ? p + WINDOW : -1;
+
+    for (tries = 0; (start < 0) && (tries < MAX_REREADS); tries++) {
+	j->rereads++;
+
+	rtail = MIN(JITTER_TAIL, dev->tracks[0].lba - (lba + 1));
+	if (read_span(dev, lba - JITTER_OVERLAP, JITTER_OVERLAP + 1 + rtail,
+		      j->reread) != 0)
+	    return -1;
+
+	p = search(j->tail, j->reread, base - MAX_SHIFT,
+		   base + MIN(MAX_SHIFT, rtail * CD_FRAME_SAMPLES), base);
+	if (p < 0)
+	    continue;
+
+	/* Find the start of frame LBA in the batch, leaving room for the
+	 * rest of the batch after it. */
+	start = search(j->reread + p + WINDOW, j->scratch, 0,
+		       (JITTER_OVERLAP + tail) * CD_FRAME_SAMPLES, base + WINDOW);
+	if (start >= 0)
+	    break;
+
+	/* The batch is no good, but the frame read again is. */
+	if (p != base)
+	    j->shifted++;
+	memcpy(buf, j->reread + p + WINDOW, CD_FRAMESIZE_RAW);
+	remember(j, buf, 1, lba);
+	return 1;
+    }
+
+    if (start < 0) {
+	/* Give up and trust the drive. */
+	j->failed++;
+	start = base + WINDOW;
+    }
+
+    if (start != base + WINDOW)
+	j->shifted++;
+
+    memcpy(buf, j->scratch + start, want * CD_FRAMESIZE_RAW);
+    remember(j, buf, want, lba);
+    return want;
+}
+
+
+/* _cd_jitter_free:
+ *  Free the jitter correction state of DEV.
+ */
+void _cd_jitter_free(cd_device *dev)
+{
+    if (dev->jitter) {
+	free(dev->jitter->scratch);
+	free(dev->jitter);
+	dev->jitter = NULL;
+    }
+}
+
+
+/* cd_set_jitter_correction:
+ *  Turn jitter correction for extraction from DEV on or off.  Return
+ *  zero on success.
+ */
+int cd_set_jitter_correction(cd_device *dev, int enable)
+{
+    struct Jitter *j = NULL;
+    int ret = 0;
+
+    pthread_once(&search_once, choose_search);
+
+    pthread_mutex_lock(&dev->lock);
+
+    if (!enable)
+	_cd_jitter_free(dev);
+    else if (!dev->jitter) {
+	j = calloc(1, sizeof(struct Jitter));
+	if (j)
+	    j->scratch = malloc((JITTER_OVERLAP + MAX_FRAMES + JITTER_TAIL)
+				* CD_FRAMESIZE_RAW);
+	if (!j || !j->scratch) {
+	    _cd_copy_error();
+	    free(j);
+	    ret = -1;
+	}
+	else {
+	    j->next_lba = -1;
+	    dev->jitter = j;
+	}
+    }
+
+    pthread_mutex_unlock(&dev->lock);
+    return ret;
+}
+
+
+/* cd_get_jitter_stats:
+ *  Return how many batches were found to be out of line and corrected,
+ *  how many times a batch was read again, and how many batches could
+ *  not be lined up at all.  Any pointer may be NULL.
+ */
+void cd_get_jitter_stats(cd_device *dev, int *shifted, int *rereads,
+			 int *failed)
+{
+    struct Jitter *j;
+
+    pthread_mutex_lock(&dev->lock);
+    j = dev->jitter;
+    if (shifted) *shifted = j ? j->shifted : 0;
+    if (rereads) *rereads = j ? j->rereads : 0;
+    if (failed)  *failed  = j ? j->failed : 0;
+    pthread_mutex_unlock(&dev->lock);
+}
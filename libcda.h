@@ -16,8 +16,31 @@ extern "C" {
 #define LIBCDA_VERSION_STR	"0.5"
 
 
+#ifdef __linux__
+
+/* Per thread.  cd_errno holds one of the following codes. */
+extern __thread const char *cd_error;
+extern __thread int cd_errno;
+
+#define CDERR_NONE		0
+#define CDERR_SYSTEM		1	/* other OS error */
+#define CDERR_NO_DISC		2
+#define CDERR_BUSY		3
+#define CDERR_NO_MEMORY		4
+#define CDERR_IO		5
+#define CDERR_TIMEOUT		6
+#define CDERR_UNSUPPORTED	7
+#define CDERR_BAD_TRACK		8
+#define CDERR_NOT_AUDIO		9
+#define CDERR_BAD_ARG		10
+#define CDERR_ABORTED		11	/* by a callback */
+
+#else
+
 extern const char *cd_error;
 
+#endif
+
 
 int cd_init(void);
 void cd_exit(void);
@@ -41,6 +64,247 @@ void cd_eject(void);
 void cd_close(void);
 
 
+#ifdef __linux__
+
+/* Linux only, for now: the same functions on an explicit drive handle,
+ * so one process can drive several CD units.  The functions above work
+ * on the drive opened by cd_init.
+ */
+typedef struct cd_device cd_device;
+
+#define CD_OPEN_SG	1	/* talk MMC through SG_IO */
+#define CD_OPEN_LAZY	2	/* read the TOC in the background */
+
+cd_device *cd_open(const char *path);
+cd_device *cd_open_ex(const char *path, int flags);
+void cd_release(cd_device *dev);
+int cd_is_ready_h(cd_device *dev);
+
+int cd_init_lazy(void);
+int cd_is_ready(void);
+int cd_ready_fd(void);
+
+
+/* Drives found by cd_find_drives. */
+#define CD_DRIVE_UNKNOWN	0
+#define CD_DRIVE_DISC		1	/* has a disc in it */
+#define CD_DRIVE_NO_DISC	2
+#define CD_DRIVE_TRAY_OPEN	3
+#define CD_DRIVE_NOT_READY	4
+#define CD_DRIVE_ERROR		5	/* could not be opened or asked */
+#define CD_DRIVE_TIMEOUT	6	/* did not answer in time */
+
+#define CD_CAN_PLAY_AUDIO	0x001
+#define CD_CAN_EJECT		0x002
+#define CD_CAN_CLOSE_TRAY	0x004
+#define CD_CAN_LOCK		0x008
+#define CD_CAN_SELECT_SPEED	0x010
+#define CD_CAN_MULTISESSION	0x020
+#define CD_CAN_READ_MCN		0x040
+#define CD_CAN_WRITE		0x080	/* CD-R or CD-RW */
+#define CD_CAN_READ_DVD		0x100
+
+typedef struct cd_drive_info {
+    char path[32];		/* for cd_open */
+    int status;			/* CD_DRIVE_* */
+    int caps;			/* CD_CAN_* */
+    int speed;			/* fastest, times 150KB/s, or zero */
+} cd_drive_info;
+
+int cd_find_drives(cd_drive_info *drives, int n, int msecs);
+void cd_set_timeout(cd_device *dev, int msecs);
+
+int cd_play_h(cd_device *dev, int track);
+int cd_play_range_h(cd_device *dev, int start, int end);
+int cd_play_from_h(cd_device *dev, int track);
+int cd_current_track_h(cd_device *dev);
+void cd_pause_h(cd_device *dev);
+void cd_resume_h(cd_device *dev);
+int cd_is_paused_h(cd_device *dev);
+void cd_stop_h(cd_device *dev);
+
+int cd_get_tracks_h(cd_device *dev, int *first, int *last);
+int cd_is_audio_h(cd_device *dev, int track);
+
+void cd_get_volume_h(cd_device *dev, int *c0, int *c1);
+void cd_set_volume_h(cd_device *dev, int c0, int c1);
+
+void cd_eject_h(cd_device *dev);
+void cd_close_h(cd_device *dev);
+
+
+/* Where playback has got to.  Positions are in frames (75 per second)
+ * and in minutes, seconds and frames.  Absolute MSF counts from the
+ * start of the lead-in, two seconds before LBA zero, as drives do.
+ */
+typedef struct cd_position {
+    int track;			/* zero if stopped */
+    int paused;
+    int abs_lba, rel_lba;	/* from the start of the disc and track */
+    int abs_min, abs_sec, abs_frame;
+    int rel_min, rel_sec, rel_frame;
+} cd_position;
+
+int cd_get_position(cd_position *pos);
+int cd_get_position_h(cd_device *dev, cd_position *pos);
+
+
+/* The whole TOC at once.  Positions and lengths are in frames. */
+#define CD_MAX_TRACKS		99
+
+typedef struct cd_layout_track {
+    int lba;			/* where it starts */
+    int length;
+    int audio;
+    int preemphasis;
+    int copy;			/* digital copying permitted */
+} cd_layout_track;
+
+typedef struct cd_layout {
+    int first, last;
+    int leadout;		/* LBA following the last track */
+    int unverified;		/* from the cache on a header match */
+    cd_layout_track track[CD_MAX_TRACKS + 1];	/* by number; 0 unused */
+} cd_layout;
+
+int cd_get_layout(cd_layout *layout);
+int cd_get_layout_h(cd_device *dev, cd_layout *layout);
+
+
+/* Digital audio extraction.  A frame is 2352 bytes of 16-bit
+ * little-endian stereo at 44100Hz (588 samples); there are 75 frames
+ * per second.
+ */
+#define CD_FRAME_BYTES		2352
+#define CD_FRAME_SAMPLES	588
+#define CD_SAMPLE_RATE		44100
+
+/* Sample formats for cd_stream_set_format; both are interleaved
+ * stereo. */
+#define CD_FORMAT_S16		0	/* 16-bit, native byte order */
+#define CD_FORMAT_F32		1	/* float, -1.0 to 1.0 */
+
+typedef struct cd_stream cd_stream;
+
+int cd_read_audio(cd_device *dev, int lba, int nframes, void *buf);
+const void *cd_map_audio(cd_device *dev, int lba, int nframes);
+int cd_get_read_batch(cd_device *dev);
+int cd_set_jitter_correction(cd_device *dev, int enable);
+void cd_get_jitter_stats(cd_device *dev, int *shifted, int *rereads,
+			 int *failed);
+
+cd_stream *cd_stream_open(cd_device *dev, int first, int last);
+void cd_stream_close(cd_stream *s);
+int cd_stream_read(cd_stream *s, void *buf, int nframes);
+int cd_stream_seek(cd_stream *s, int pos);
+int cd_stream_tell(cd_stream *s);
+int cd_stream_length(cd_stream *s);
+int cd_stream_queue(cd_stream *s, int first, int last);
+int cd_stream_track(cd_stream *s);
+
+int cd_stream_readahead(cd_stream *s, int msecs);
+int cd_stream_set_format(cd_stream *s, int rate, int format);
+int cd_stream_buffered(cd_stream *s);
+int cd_stream_pull(cd_stream *s, void *dst, int n);
+
+/* Checksums of a track, worked out while it is extracted. */
+typedef struct cd_checksums {
+    unsigned long crc32;	/* of the audio data, as EAC gives it */
+    unsigned long accuraterip_v1;
+    unsigned long accuraterip_v2;
+} cd_checksums;
+
+int cd_get_checksums(cd_device *dev, int track, cd_checksums *out);
+
+/* Disc identifiers, for looking the disc up online. */
+typedef struct cd_disc_ids {
+    unsigned long freedb_id;
+    char freedb[9];		/* the same, as 8 hex digits */
+    char musicbrainz[29];
+    unsigned long accuraterip_id1, accuraterip_id2;
+    char accuraterip[40];	/* "NNN-id1-id2-freedb", as in its URLs */
+    int unverified;		/* from a TOC the cache matched by header */
+} cd_disc_ids;
+
+int cd_get_disc_ids(cd_device *dev, cd_disc_ids *ids);
+
+int cd_set_cache(cd_device *dev, const char *path);
+
+
+/* Ripping: audio is read on the calling thread and handed over, a block
+ * at a time, to a callback run on a pool of worker threads.
+ */
+typedef struct cd_rip_block {
+    int track;
+    int frame;			/* of the track where the block starts */
+    int nframes;
+    int last;			/* the block ends the track */
+    const void *data;		/* NFRAMES frames */
+    const cd_checksums *sums;	/* on the last block, if complete */
+} cd_rip_block;
+
+typedef int (*cd_rip_func)(const cd_rip_block *block, void *arg);
+
+int cd_rip(cd_device *dev, int first, int last, int block_frames,
+	   int nthreads, cd_rip_func func, void *arg);
+
+/* One drive of several ripped at once by cd_rip_drives. */
+typedef struct cd_rip_drive {
+    cd_device *dev;
+    int first, last;
+    cd_rip_func func;
+    void *arg;
+    int result;			/* set: what cd_rip would return */
+    int error;			/* set: cd_errno, if it failed */
+} cd_rip_drive;
+
+int cd_rip_drives(cd_rip_drive *drives, int n, int block_frames,
+		  int nthreads);
+
+
+/* Asynchronous commands.  The arguments of each are those of the
+ * function named in the comment.
+ */
+#define CD_OP_READ_AUDIO	1	/* cd_read_audio(lba, nframes, buf) */
+#define CD_OP_PLAY		2	/* cd_play_range(start, end) */
+#define CD_OP_PAUSE		3
+#define CD_OP_RESUME		4
+#define CD_OP_STOP		5
+#define CD_OP_EJECT		6
+#define CD_OP_CLOSE		7
+#define CD_OP_READ_TOC		8	/* cd_get_tracks */
+
+typedef struct cd_request cd_request;
+
+cd_request *cd_submit(cd_device *dev, int op, int arg0, int arg1, void *buf);
+cd_request *cd_submit_read(cd_device *dev, int lba, int nframes, void *buf);
+int cd_request_done(cd_request *req);
+int cd_request_wait(cd_device *dev, cd_request *req);
+void cd_request_free(cd_request *req);
+int cd_async_fd(cd_device *dev);
+
+
+/* Call statistics, off until cd_enable_stats.  hist[0] counts calls
+ * taking under 1us, hist[i] from 2^(i-1) to 2^i us, and the last
+ * bucket everything longer.
+ */
+#define CD_STAT_BUCKETS		32
+
+typedef struct cd_stat {
+    const char *name;		/* "cd_play", "CDROMSUBCHNL", ... */
+    unsigned long calls;
+    unsigned long errors;
+    unsigned long max_us;
+    unsigned long hist[CD_STAT_BUCKETS];
+} cd_stat;
+
+int cd_enable_stats(cd_device *dev, int enable);
+int cd_get_stats(cd_device *dev, cd_stat *out, int n);
+void cd_reset_stats(cd_device *dev);
+
+#endif
+
+
 #ifdef __cplusplus
 }
 #endif
@@ -4,13 +4,15 @@
  */
 
 #include <string.h>
+#include <strings.h>
 #include <stdlib.h>
+#include <limits.h>
 #include <unistd.h>
 #include <fcntl.h>
+#include <time.h>
 #include <sys/ioctl.h>
-#include <linux/cdrom.h>
 #include <errno.h>
-#include "libcda.h"
+#include "cdaint.h"
 
 
 /* It appears not all drivers support the CDROMPLAYTRKIND ioctl yet 
@@ -19,128 +21,377 @@
 #define USE_PLAYMSF
 
 
-#define MIN(x,y)     (((x) < (y)) ? (x) : (y))
-#define MAX(x,y)     (((x) > (y)) ? (x) : (y))
-#define MID(x,y,z)   MAX((x), MIN((y), (z)))
+/* The TOC is cached in memory and only reread when the drive reports
+ * that the media has changed.  Asking the drive is not free either, so
+ * we only do it this often (milliseconds).
+ */
+#define MEDIA_CHECK_INTERVAL	500
+
+
+/* cd_current_track and cd_is_paused answer from the last published
+ * status if it is younger than this (milliseconds), or if someone else
+ * is busy talking to the drive.
+ */
+#define STATUS_MAX_AGE		100
+
+
+/* While playing, where the drive has got to can be worked out from the
+ * clock, so the status is only checked with the drive this often
+ * (milliseconds), or when the clock says the track has ended.
+ */
+#define POSITION_SYNC_INTERVAL	1000
+
+
+/* Extraction starts with small requests and doubles them while that
+ * makes reading faster (by at least BATCH_GAIN percent), up to what the
+ * driver says it can take, shrinking again if the drive complains.
+ */
+#define MIN_READ_FRAMES		4
+#define BATCH_GAIN		10
+
+
+/* Per-command timeout, where the driver can do anything about it. */
+#define DEFAULT_TIMEOUT		10000
 
 
-static int fd = -1;
+/* The device used by the cd_* functions without a handle. */
+static cd_device *default_dev;
 
-static char _cd_error[256];
-const char *cd_error = _cd_error;
+static __thread char _cd_error[256];
+__thread const char *cd_error = "";
+__thread int cd_errno;
 
 
-static void copy_cd_error(void)
+void _cd_set_error(int code, const char *s)
 {
-    strncpy(_cd_error, strerror(errno), sizeof _cd_error);
+    strncpy(_cd_error, s, sizeof _cd_error);
     _cd_error[sizeof _cd_error - 1] = 0;
+    cd_error = _cd_error;
+    cd_errno = code;
+}
+
+
+void _cd_copy_error(void)
+{
+    int e = errno;
+    int code;
+
+    switch (e) {
+	case ENOMEDIUM:
+	    code = CDERR_NO_DISC;
+	    break;
+	case EBUSY:
+	    code = CDERR_BUSY;
+	    break;
+	case ENOMEM:
+	    code = CDERR_NO_MEMORY;
+	    break;
+	case EIO:
+	    code = CDERR_IO;
+	    break;
+	case ETIMEDOUT:
+	    code = CDERR_TIMEOUT;
+	    break;
+	case ENOTTY:
+	case ENOSYS:
+	case EOPNOTSUPP:
+	    code = CDERR_UNSUPPORTED;
+	    break;
+	default:
+	    code = CDERR_SYSTEM;
+	    break;
+    }
+
+    _cd_set_error(code, strerror(e));
+}
+
+
+static long get_msecs(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+
+static void lock(cd_device *dev)
+{
+    pthread_mutex_lock(&dev->lock);
+}
+
+
+static void unlock(cd_device *dev)
+{
+    pthread_mutex_unlock(&dev->lock);
+}
+
+
+/* publish_status:
+ *  Make a new drive status visible to readers: doing AUDIOSTATUS, in
+ *  TRACK, at LBA.  Call with the lock held.
+ */
+static void publish_status(cd_device *dev, int audiostatus, int track,
+			   int lba)
+{
+    Status *st = &dev->status;
+    int seq = __atomic_load_n(&st->seq, __ATOMIC_RELAXED);
+    int start = 0, end = -1;
+
+    if ((dev->toc_valid) &&
+	(track >= dev->first_track) && (track <= dev->last_track)) {
+	start = dev->tracks[track].lba;
+	end = (track == dev->last_track) ? dev->tracks[0].lba
+					 : dev->tracks[track + 1].lba;
+    }
+
+    __atomic_store_n(&st->seq, seq + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    __atomic_store_n(&st->audiostatus, audiostatus, __ATOMIC_RELAXED);
+    __atomic_store_n(&st->track, track, __ATOMIC_RELAXED);
+    __atomic_store_n(&st->lba, lba, __ATOMIC_RELAXED);
+    __atomic_store_n(&st->track_start, start, __ATOMIC_RELAXED);
+    __atomic_store_n(&st->track_end, end, __ATOMIC_RELAXED);
+    __atomic_store_n(&st->time, get_msecs(), __ATOMIC_RELAXED);
+    __atomic_store_n(&st->seq, seq + 2, __ATOMIC_RELEASE);
+}
+
+
+/* read_status:
+ *  Take a consistent copy of the published status, without locking.
+ */
+static void read_status(cd_device *dev, Status *out)
+{
+    Status *st = &dev->status;
+    int seq;
+
+    do {
+	seq = __atomic_load_n(&st->seq, __ATOMIC_ACQUIRE);
+	out->audiostatus = __atomic_load_n(&st->audiostatus, __ATOMIC_RELAXED);
+	out->track = __atomic_load_n(&st->track, __ATOMIC_RELAXED);
+	out->lba = __atomic_load_n(&st->lba, __ATOMIC_RELAXED);
+	out->track_start = __atomic_load_n(&st->track_start, __ATOMIC_RELAXED);
+	out->track_end = __atomic_load_n(&st->track_end, __ATOMIC_RELAXED);
+	out->time = __atomic_load_n(&st->time, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_ACQUIRE);
+    } while ((seq & 1) || (seq != __atomic_load_n(&st->seq, __ATOMIC_RELAXED)));
+
+    out->seq = seq;
+}
+
+
+static double get_secs(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+
+/* The cdrom driver's generic ioctls. */
+
+static int msf_to_lba(struct cdrom_msf0 *msf)
+{
+    return (msf->minute * CD_SECS + msf->second) * CD_FRAMES + msf->frame
+	- CD_MSF_OFFSET;
+}
+
+
+static void lba_to_msf(int lba, struct cdrom_msf0 *msf)
+{
+    lba += CD_MSF_OFFSET;
+    msf->minute = lba / (CD_SECS * CD_FRAMES);
+    msf->second = (lba / CD_FRAMES) % CD_SECS;
+    msf->frame = lba % CD_FRAMES;
+}
+
+
+/* dev_ioctl:
+ *  ioctl on the drive, counted in the statistics as WHAT.
+ */
+static int dev_ioctl(cd_device *dev, int what, unsigned long request,
+		     void *arg)
+{
+    uint64_t t = _cd_stats_start(dev);
+    int ret = ioctl(dev->fd, request, arg);
+
+    _cd_stats_end(dev, what, t, ret < 0);
+    return ret;
+}
+
+
+static int ioctl_open(cd_device *dev, const char *path)
+{
+    dev->fd = open(path, O_RDONLY | O_NONBLOCK);
+    if (dev->fd < 0) {
+	_cd_copy_error();
+	return -1;
+    }
+
+    return 0;
+}
+
+
+static void ioctl_close(cd_device *dev)
+{
+    close(dev->fd);
 }
 
 
-static int get_tocentry(int track, struct cdrom_tocentry *e)
+static int get_tocentry(cd_device *dev, int track, struct cdrom_tocentry *e)
 {
     memset(e, 0, sizeof(struct cdrom_tocentry));
     e->cdte_track = track;
     e->cdte_format = CDROM_MSF;
-    
-    if (ioctl(fd, CDROMREADTOCENTRY, e) < 0) {
-	copy_cd_error();
+
+    if (dev_ioctl(dev, STAT_READTOCENTRY, CDROMREADTOCENTRY, e) < 0) {
+	_cd_copy_error();
 	return -1;
     }
-    
+
     return 0;
 }
 
 
-static int get_subchnl(struct cdrom_subchnl *s)
+static int ioctl_read_toc(cd_device *dev)
 {
-    memset(s, 0, sizeof(struct cdrom_subchnl));
-    s->cdsc_format = CDROM_MSF;
-    if (ioctl(fd, CDROMSUBCHNL, s) < 0) {
-	copy_cd_error();
+    struct cdrom_tochdr hdr;
+    struct cdrom_tocentry e;
+    int i;
+
+    if (dev_ioctl(dev, STAT_READTOCHDR, CDROMREADTOCHDR, &hdr) < 0) {
+	_cd_copy_error();
 	return -1;
     }
-   
+
+    for (i = hdr.cdth_trk0; i <= hdr.cdth_trk1; i++) {
+	if (get_tocentry(dev, i, &e) != 0)
+	    return -1;
+	dev->tracks[i].ctrl = e.cdte_ctrl;
+	dev->tracks[i].lba = msf_to_lba(&e.cdte_addr.msf);
+    }
+
+    /* cdrom.h: The leadout track is always 0xAA, regardless
+     * of # of tracks on disc. */
+    if (get_tocentry(dev, CDROM_LEADOUT, &e) != 0)
+	return -1;
+    dev->tracks[0].ctrl = CDROM_DATA_TRACK;
+    dev->tracks[0].lba = msf_to_lba(&e.cdte_addr.msf);
+
+    dev->first_track = hdr.cdth_trk0;
+    dev->last_track = hdr.cdth_trk1;
     return 0;
 }
 
 
-/* cd_init:
- *  Initialise library.  Return zero on success.
+/* ioctl_read_toc_header:
+ *  Read just enough of the TOC to recognise the disc.
  */
-int cd_init()
+static int ioctl_read_toc_header(cd_device *dev, int *first, int *last,
+				 int *leadout)
 {
-    char *device;
-
-    device = getenv("CDAUDIO");
-    if (!device) device = "/dev/cdrom";
-
-    if (fd != -1) close(fd);
+    struct cdrom_tochdr hdr;
+    struct cdrom_tocentry e;
 
-    fd = open(device, O_RDONLY | O_NONBLOCK);
-    if (fd < 0) {
-	copy_cd_error();
+    if (dev_ioctl(dev, STAT_READTOCHDR, CDROMREADTOCHDR, &hdr) < 0) {
+	_cd_copy_error();
 	return -1;
     }
-	
+
+    if (get_tocentry(dev, CDROM_LEADOUT, &e) != 0)
+	return -1;
+
+    *first = hdr.cdth_trk0;
+    *last = hdr.cdth_trk1;
+    *leadout = msf_to_lba(&e.cdte_addr.msf);
     return 0;
 }
 
 
-/* cd_exit:
- *  Shutdown.
- */
-void cd_exit()
+static int ioctl_media_changed(cd_device *dev)
+{
+    int status;
+
+    /* Both of these may fail if the driver doesn't implement them,
+     * in which case we have to trust the cached copy. */
+    if (dev_ioctl(dev, STAT_MEDIA_CHANGED, CDROM_MEDIA_CHANGED,
+		  (void *)CDSL_CURRENT) > 0)
+	return 1;
+
+    status = dev_ioctl(dev, STAT_DRIVE_STATUS, CDROM_DRIVE_STATUS,
+		       (void *)CDSL_CURRENT);
+    if ((status == CDS_NO_DISC) || (status == CDS_TRAY_OPEN) ||
+	(status == CDS_DRIVE_NOT_READY))
+	return 1;
+
+    return 0;
+}
+
+
+static int ioctl_max_read_frames(cd_device *dev)
+{
+    (void)dev;
+
+    /* The most the cdrom driver accepts in one CDROMREADAUDIO. */
+    return CD_FRAMES;
+}
+
+
+static int ioctl_read_audio(cd_device *dev, int lba, int nframes,
+			    unsigned char *buf)
 {
-    if (fd != -1) {
-	close(fd);
-	fd = -1;
+    struct cdrom_read_audio ra;
+
+    ra.addr.lba = lba;
+    ra.addr_format = CDROM_LBA;
+    ra.nframes = nframes;
+    ra.buf = buf;
+
+    if (dev_ioctl(dev, STAT_READAUDIO, CDROMREADAUDIO, &ra) < 0) {
+	_cd_copy_error();
+	return -1;
     }
+
+    return 0;
 }
 
 
-static int play(int t1, int t2)
+static int ioctl_play(cd_device *dev, int lba0, int lba1)
 {
 #ifdef USE_PLAYMSF
-    struct cdrom_tocentry e0, e1;
     struct cdrom_msf msf;
-    int last;
+    struct cdrom_msf0 m0, m1;
 
-    if (cd_get_tracks(0, &last) != 0)
-	return -1;
-    
-    /* cdrom.h: The leadout track is always 0xAA, regardless 
-     * of # of tracks on disc. */
-    if (t2 == last)
-	t2 = CDROM_LEADOUT;
-    else
-	t2++;
-    
-    if ((get_tocentry(t1, &e0) != 0) ||
-	(get_tocentry(t2, &e1) != 0))
-	return -1;
+    lba_to_msf(lba0, &m0);
+    lba_to_msf(lba1, &m1);
 
-    msf.cdmsf_min0 = e0.cdte_addr.msf.minute;
-    msf.cdmsf_sec0 = e0.cdte_addr.msf.second;
-    msf.cdmsf_frame0 = e0.cdte_addr.msf.frame;
-    msf.cdmsf_min1 = e1.cdte_addr.msf.minute;
-    msf.cdmsf_sec1 = e1.cdte_addr.msf.second;
-    msf.cdmsf_frame1 = e1.cdte_addr.msf.frame;
-    
-    if (ioctl(fd, CDROMPLAYMSF, &msf) < 0) {
-	copy_cd_error();
+    msf.cdmsf_min0 = m0.minute;
+    msf.cdmsf_sec0 = m0.second;
+    msf.cdmsf_frame0 = m0.frame;
+    msf.cdmsf_min1 = m1.minute;
+    msf.cdmsf_sec1 = m1.second;
+    msf.cdmsf_frame1 = m1.frame;
+
+    if (dev_ioctl(dev, STAT_PLAYMSF, CDROMPLAYMSF, &msf) < 0) {
+	_cd_copy_error();
 	return -1;
     }
-    
+
     return 0;
 #else
     struct cdrom_ti idx;
+    int t;
 
     memset(&idx, 0, sizeof(idx));
-    idx.cdti_trk0 = t1;
-    idx.cdti_trk1 = t2;
-    if (ioctl(fd, CDROMPLAYTRKIND, &idx) < 0) {
-	copy_cd_error();
+    for (t = dev->first_track; t <= dev->last_track; t++) {
+	if (dev->tracks[t].lba == lba0)
+	    idx.cdti_trk0 = t;
+	if ((dev->tracks[t].lba < lba1))
+	    idx.cdti_trk1 = t;
+    }
+    if (dev_ioctl(dev, STAT_PLAYTRKIND, CDROMPLAYTRKIND, &idx) < 0) {
+	_cd_copy_error();
 	return -1;
     }
 
@@ -149,168 +400,1473 @@ static int play(int t1, int t2)
 }
 
 
-/* cd_play:
- *  Play specified track.  Return zero on success.
- */
-int cd_play(int track)
+static int simple_ioctl(cd_device *dev, int what, unsigned long request)
 {
-    return play(track, track);
+    if (dev_ioctl(dev, what, request, NULL) < 0) {
+	_cd_copy_error();
+	return -1;
+    }
+
+    return 0;
 }
 
 
-/* cd_play_range:
- *  Play from START to END tracks.  Return zero on success.
- */
-int cd_play_range(int start, int end)
+static int ioctl_pause(cd_device *dev)
 {
-    return play(start, end);
+    return simple_ioctl(dev, STAT_CDROMPAUSE, CDROMPAUSE);
 }
 
 
-/* cd_play_from:
- *  Play from track to end of disc.  Return zero on success.
- */
-int cd_play_from(int track)
+static int ioctl_resume(cd_device *dev)
+{
+    return simple_ioctl(dev, STAT_CDROMRESUME, CDROMRESUME);
+}
+
+
+static int ioctl_stop(cd_device *dev)
 {
-    int last;
-    
-    if (cd_get_tracks(0, &last) != 0)
+    return simple_ioctl(dev, STAT_CDROMSTOP, CDROMSTOP);
+}
+
+
+static int ioctl_eject(cd_device *dev)
+{
+    return simple_ioctl(dev, STAT_CDROMEJECT, CDROMEJECT);
+}
+
+
+static int ioctl_close_tray(cd_device *dev)
+{
+    return simple_ioctl(dev, STAT_CLOSETRAY, CDROMCLOSETRAY);
+}
+
+
+static int ioctl_get_subchnl(cd_device *dev, Subchnl *s)
+{
+    struct cdrom_subchnl sc;
+
+    memset(&sc, 0, sizeof sc);
+    sc.cdsc_format = CDROM_LBA;
+    if (dev_ioctl(dev, STAT_SUBCHNL, CDROMSUBCHNL, &sc) < 0) {
+	_cd_copy_error();
 	return -1;
-    
-    return play(track, last);
+    }
+
+    s->audiostatus = sc.cdsc_audiostatus;
+    s->track = sc.cdsc_trk;
+    s->abs_lba = sc.cdsc_absaddr.lba;
+    s->rel_lba = sc.cdsc_reladdr.lba;
+    return 0;
 }
 
 
-/* cd_current_track:
- *  Return track currently in playback, or zero if stopped.
- */
-int cd_current_track()
+static int ioctl_get_volume(cd_device *dev, int *c0, int *c1)
 {
-    struct cdrom_subchnl s;
+    struct cdrom_volctrl vol;
 
-    get_subchnl(&s);
-    if (s.cdsc_audiostatus == CDROM_AUDIO_PLAY)
-	return s.cdsc_trk;
-    else
-	return 0;
+    if (dev_ioctl(dev, STAT_VOLREAD, CDROMVOLREAD, &vol) < 0) {
+	_cd_copy_error();
+	return -1;
+    }
+
+    *c0 = vol.channel0;
+    *c1 = vol.channel1;
+    return 0;
 }
 
 
-/* cd_pause:
- *  Pause playback.
- */
-void cd_pause()
+static int ioctl_set_volume(cd_device *dev, int c0, int c1)
 {
-    ioctl(fd, CDROMPAUSE);
+    struct cdrom_volctrl vol;
+
+    vol.channel0 = c0;
+    vol.channel1 = c1;
+    vol.channel2 = 0;
+    vol.channel3 = 0;
+    if (dev_ioctl(dev, STAT_VOLCTRL, CDROMVOLCTRL, &vol) < 0) {
+	_cd_copy_error();
+	return -1;
+    }
+
+    return 0;
 }
 
 
-/* cd_resume:
- *  Resume playback.
+const Driver _cd_driver_ioctl = {
+    "ioctl",
+    ioctl_open,
+    ioctl_close,
+    ioctl_read_toc,
+    ioctl_media_changed,
+    ioctl_max_read_frames,
+    ioctl_read_audio,
+    ioctl_play,
+    ioctl_pause,
+    ioctl_resume,
+    ioctl_stop,
+    ioctl_get_subchnl,
+    ioctl_get_volume,
+    ioctl_set_volume,
+    ioctl_eject,
+    ioctl_close_tray,
+    NULL,
+    ioctl_read_toc_header
+};
+
+
+/* Generic part. */
+
+/* poll_status:
+ *  Ask the drive what it is doing and publish it.  Call with the lock
+ *  held.
  */
-void cd_resume()
+static void poll_status(cd_device *dev)
 {
-    if (cd_is_paused())
-	ioctl(fd, CDROMRESUME);
+    Subchnl s;
+
+    if (dev->driver->get_subchnl(dev, &s) != 0)
+	publish_status(dev, CDROM_AUDIO_NO_STATUS, 0, 0);
+    else
+	publish_status(dev, s.audiostatus, s.track, s.abs_lba);
 }
 
 
-/* cd_is_paused:
- *  Return non-zero if playback is paused.
+/* status_lba:
+ *  Return where the drive should be at NOW, going by ST: if it was
+ *  playing, it has moved on 75 frames a second since.
  */
-int cd_is_paused()
+static int status_lba(Status *st, long now)
 {
-    struct cdrom_subchnl s;
+    if (st->audiostatus != CDROM_AUDIO_PLAY)
+	return st->lba;
 
-    get_subchnl(&s);
-    return (s.cdsc_audiostatus == CDROM_AUDIO_PAUSED);
+    return st->lba + (int)((now - st->time) * CD_FRAMES / 1000);
 }
 
 
-/* cd_stop:
- *  Stop playback.
+/* get_status:
+ *  Return the drive status in OUT.  This avoids the lock (and the 
+ *  drive) if the last published status is recent enough, or if it is
+ *  playing and the clock says it is still in the same track, or if
+ *  some other thread is in the middle of a slow command.
  */
-void cd_stop()
+static void get_status(cd_device *dev, Status *out)
 {
-    ioctl(fd, CDROMSTOP);
+    long now;
+
+    read_status(dev, out);
+    now = get_msecs();
+
+    if (now - out->time < STATUS_MAX_AGE)
+	return;
+
+    if ((out->audiostatus == CDROM_AUDIO_PLAY) && (out->track_end >= 0) &&
+	(now - out->time < POSITION_SYNC_INTERVAL) &&
+	(status_lba(out, now) < out->track_end))
+	return;
+
+    if (pthread_mutex_trylock(&dev->lock) != 0)
+	return;
+
+    poll_status(dev);
+    unlock(dev);
+    read_status(dev, out);
 }
 
 
-/* cd_get_tracks:
- *  Get first and last tracks of CD.  Return zero on success.
+/* read_toc:
+ *  Read the whole TOC into the tracks array, like get_audio_info()
+ *  in the djgpp version, unless the disc is in the cache.  Return zero
+ *  on success.
  */
-int cd_get_tracks(int *first, int *last)
+static int read_toc(cd_device *dev)
 {
-    struct cdrom_tochdr toc;
+    int ret;
+
+    dev->toc_valid = 0;
+    _cd_checksum_reset(dev);
 
-    if (ioctl(fd, CDROMREADTOCHDR, &toc) < 0) {
-	copy_cd_error();
-	if (first) *first = 0;
-	if (last) *last = 0;
+    ret = _cd_cache_read_toc(dev);
+    if (ret < 0)
 	return -1;
+
+    if (ret == 0) {
+	if (dev->driver->read_toc(dev) != 0)
+	    return -1;
+	_cd_cache_add_toc(dev);
     }
 
-    if (first) *first = toc.cdth_trk0;
-    if (last)  *last  = toc.cdth_trk1;
+    dev->toc_unverified = (ret == 1);
+    dev->toc_valid = 1;
     return 0;
 }
 
 
-/* cd_is_audio:
- *  Return 1 if track specified is audio,
- *  zero if it is data, -1 if an error occurs.
+/* media_changed:
+ *  Return non-zero if the disc may have been changed since the TOC
+ *  was read.  Drives are only asked every MEDIA_CHECK_INTERVAL ms.
  */
-int cd_is_audio(int track)
+static int media_changed(cd_device *dev)
 {
-    struct cdrom_tocentry e;
+    long now = get_msecs();
 
-    if ((cd_get_tracks(0, 0) < 0) || (get_tocentry(track, &e) < 0))
-	return -1;
-    return (e.cdte_ctrl & CDROM_DATA_TRACK) ? 0 : 1;
+    if (now - dev->last_media_check < MEDIA_CHECK_INTERVAL)
+	return 0;
+    dev->last_media_check = now;
+
+    return dev->driver->media_changed(dev);
 }
 
 
-/* cd_get_volume:
- *  Return volumes of left and right channels.
+/* update_toc:
+ *  Make sure the cached TOC is current.  Return zero on success.
  */
-void cd_get_volume(int *c0, int *c1)
+static int update_toc(cd_device *dev)
 {
-    struct cdrom_volctrl vol;
+    if (dev->toc_valid && !media_changed(dev))
+	return 0;
+
+    return read_toc(dev);
+}
+
+
+static int valid_track(cd_device *dev, int track)
+{
+    if ((track < dev->first_track) || (track > dev->last_track)) {
+	_cd_set_error(CDERR_BAD_TRACK, "Track out of range");
+	return 0;
+    }
 
-    ioctl(fd, CDROMVOLREAD, &vol);
-    if (c0) *c0 = vol.channel0;
-    if (c1) *c1 = vol.channel1;
+    return 1;
 }
 
 
-/* cd_set_volume:
- *  Set left and right channel volumes (0 - 255).
+/* track_end:
+ *  Return the LBA following the end of TRACK.
  */
-void cd_set_volume(int c0, int c1)
+static int track_end(cd_device *dev, int track)
 {
-    struct cdrom_volctrl vol;
+    if (track == dev->last_track)
+	return dev->tracks[0].lba;
+    else
+	return dev->tracks[track + 1].lba;
+}
 
-    vol.channel0 = MID(0, c0, 255);
-    vol.channel1 = MID(0, c1, 255);
-    vol.channel2 = 0;
-    vol.channel3 = 0;
-    ioctl(fd, CDROMVOLCTRL, &vol);
+
+/* is_cue_sheet:
+ *  Return non-zero if PATH names a disc image rather than a drive.
+ */
+static int is_cue_sheet(const char *path)
+{
+    size_t len = strlen(path);
+
+    return (len > 4) && (strcasecmp(path + len - 4, ".cue") == 0);
 }
 
 
-/* cd_eject:
- *  Eject CD drive (if possible).
+/* start_lazy:
+ *  Start reading the TOC of DEV in the background, unless the drive
+ *  says there is no disc to read, in which case it is ready already.
+ *  If the TOC can't be read in the background, it will be read when it
+ *  is first needed.
  */
-void cd_eject()
+static void start_lazy(cd_device *dev)
 {
-    ioctl(fd, CDROMEJECT);
+    int status = -1;
+
+    if (dev->fd >= 0)
+	status = dev_ioctl(dev, STAT_DRIVE_STATUS, CDROM_DRIVE_STATUS,
+			   (void *)CDSL_CURRENT);
+
+    if ((status == CDS_NO_DISC) || (status == CDS_TRAY_OPEN)) {
+	lock(dev);
+	_cd_async_signal(dev);
+	unlock(dev);
+	return;
+    }
+
+    dev->ready_req = cd_submit(dev, CD_OP_READ_TOC, 0, 0, NULL);
 }
 
 
-/* cd_close:
- *  Close CD drive (if possible).
+/* cd_open_ex:
+ *  Open a CD drive.  If PATH is NULL, use $CDAUDIO or /dev/cdrom.  If
+ *  it is a .cue file, open the disc image instead, and if it starts
+ *  with "emu:", an emulated drive.  FLAGS is a combination of the
+ *  CD_OPEN_* flags.  Return NULL on error.
  */
-void cd_close()
+cd_device *cd_open_ex(const char *path, int flags)
+{
+    const char *cache;
+    cd_device *dev;
+
+    if (!path) path = getenv("CDAUDIO");
+    if (!path) path = "/dev/cdrom";
+
+    dev = calloc(1, sizeof(cd_device));
+    if (!dev) {
+	_cd_copy_error();
+	return NULL;
+    }
+
+    if (flags & CD_OPEN_SG)
+	dev->driver = &_cd_driver_sg;
+    else if (strncmp(path, "emu:", 4) == 0)
+	dev->driver = &_cd_driver_emu;
+    else if (is_cue_sheet(path))
+	dev->driver = &_cd_driver_image;
+    else
+	dev->driver = &_cd_driver_ioctl;
+
+    dev->fd = -1;
+    dev->timeout = DEFAULT_TIMEOUT;
+    dev->volume = 255 | (255 << 8);
+    pthread_mutex_init(&dev->lock, NULL);
+    pthread_mutex_init(&dev->async_lock, NULL);
+
+    if (dev->driver->open(dev, path) != 0) {
+	pthread_mutex_destroy(&dev->async_lock);
+	pthread_mutex_destroy(&dev->lock);
+	free(dev);
+	return NULL;
+    }
+
+    dev->batch_max = dev->driver->max_read_frames(dev);
+    dev->batch = MIN(MIN_READ_FRAMES, dev->batch_max);
+    dev->next_lba = -1;
+
+    /* The cache is optional, so failing to open it is not an error. */
+    cache = getenv("CDAUDIO_CACHE");
+    if ((cache) && (*cache))
+	cd_set_cache(dev, cache);
+
+    /* Not having a disc in the drive yet is not an error. */
+    dev->last_media_check = get_msecs();
+    if (flags & CD_OPEN_LAZY)
+	start_lazy(dev);
+    else {
+	read_toc(dev);
+	poll_status(dev);
+    }
+
+    return dev;
+}
+
+
+/* cd_open:
+ *  Open a CD drive with the default driver.
+ */
+cd_device *cd_open(const char *path)
 {
-    ioctl(fd, CDROMCLOSETRAY);
+    return cd_open_ex(path, 0);
+}
+
+
+/* cd_release:
+ *  Close a drive opened with cd_open.
+ */
+void cd_release(cd_device *dev)
+{
+    if (dev) {
+	_cd_async_shutdown(dev);
+	if (dev->ready_req)
+	    cd_request_free(dev->ready_req);
+	_cd_jitter_free(dev);
+	_cd_stats_free(dev);
+	_cd_cache_close(dev);
+	dev->driver->close(dev);
+	pthread_mutex_destroy(&dev->async_lock);
+	pthread_mutex_destroy(&dev->lock);
+	free(dev);
+    }
+}
+
+
+/* cd_is_ready_h:
+ *  Return 1 if DEV has finished opening, zero if it is still reading the
+ *  TOC in the background, or -1 if that failed.
+ */
+int cd_is_ready_h(cd_device *dev)
+{
+    if (!dev->ready_req)
+	return 1;
+
+    if (!cd_request_done(dev->ready_req))
+	return 0;
+
+    /* Doesn't wait, but sets cd_error. */
+    return (cd_request_wait(dev, dev->ready_req) == 0) ? 1 : -1;
+}
+
+
+/* cd_set_timeout:
+ *  Set the longest any one command to the drive may take, in
+ *  milliseconds.  Only the SG driver can enforce it.
+ */
+void cd_set_timeout(cd_device *dev, int msecs)
+{
+    lock(dev);
+    dev->timeout = MAX(1, msecs);
+    unlock(dev);
+}
+
+
+/* no_default_dev:
+ *  Return non-zero, and set the error, if cd_init hasn't opened a drive.
+ */
+static int no_default_dev(void)
+{
+    if (default_dev)
+	return 0;
+
+    _cd_set_error(CDERR_NO_DISC, "No drive open");
+    return 1;
+}
+
+
+static int init(int flags)
+{
+    const char *driver = getenv("CDAUDIO_DRIVER");
+
+    if ((driver) && (strcmp(driver, "sg") == 0))
+	flags |= CD_OPEN_SG;
+
+    cd_release(default_dev);
+
+    default_dev = cd_open_ex(NULL, flags);
+    return (default_dev) ? 0 : -1;
+}
+
+
+/* cd_init:
+ *  Initialise library.  Return zero on success.
+ */
+int cd_init()
+{
+    return init(0);
+}
+
+
+/* cd_init_lazy:
+ *  Like cd_init, but return without waiting for the drive.  Return
+ *  zero on success.
+ */
+int cd_init_lazy()
+{
+    return init(CD_OPEN_LAZY);
+}
+
+
+/* cd_ready_fd:
+ *  Return a file descriptor which becomes readable when the drive
+ *  opened by cd_init_lazy is ready (see cd_async_fd).
+ */
+int cd_ready_fd()
+{
+    if (no_default_dev())
+	return -1;
+
+    return cd_async_fd(default_dev);
+}
+
+
+/* cd_exit:
+ *  Shutdown.
+ */
+void cd_exit()
+{
+    cd_release(default_dev);
+    default_dev = NULL;
+}
+
+
+static int play(cd_device *dev, int t1, int t2)
+{
+    if ((update_toc(dev) != 0) ||
+	!valid_track(dev, t1) || !valid_track(dev, t2))
+	return -1;
+
+    if (dev->driver->play(dev, dev->tracks[t1].lba, track_end(dev, t2)) != 0)
+	return -1;
+
+    publish_status(dev, CDROM_AUDIO_PLAY, t1, dev->tracks[t1].lba);
+    return 0;
+}
+
+
+/* cd_play_h:
+ *  Play specified track.  Return zero on success.
+ */
+int cd_play_h(cd_device *dev, int track)
+{
+    uint64_t t = _cd_stats_start(dev);
+    int ret;
+
+    lock(dev);
+    ret = play(dev, track, track);
+    unlock(dev);
+    _cd_stats_end(dev, STAT_PLAY, t, ret != 0);
+    return ret;
+}
+
+
+/* cd_play_range_h:
+ *  Play from START to END tracks.  Return zero on success.
+ */
+int cd_play_range_h(cd_device *dev, int start, int end)
+{
+    uint64_t t = _cd_stats_start(dev);
+    int ret;
+
+    lock(dev);
+    ret = play(dev, start, end);
+    unlock(dev);
+    _cd_stats_end(dev, STAT_PLAY_RANGE, t, ret != 0);
+    return ret;
+}
+
+
+/* cd_play_from_h:
+ *  Play from track to end of disc.  Return zero on success.
+ */
+int cd_play_from_h(cd_device *dev, int track)
+{
+    uint64_t t = _cd_stats_start(dev);
+    int ret = -1;
+
+    lock(dev);
+    if (update_toc(dev) == 0)
+	ret = play(dev, track, dev->last_track);
+    unlock(dev);
+    _cd_stats_end(dev, STAT_PLAY_FROM, t, ret != 0);
+    return ret;
+}
+
+
+/* cd_current_track_h:
+ *  Return track currently in playback, or zero if stopped.
+ */
+int cd_current_track_h(cd_device *dev)
+{
+    uint64_t t = _cd_stats_start(dev);
+    Status st;
+
+    get_status(dev, &st);
+    _cd_stats_end(dev, STAT_CURRENT_TRACK, t, 0);
+    if (st.audiostatus == CDROM_AUDIO_PLAY)
+	return st.track;
+    else
+	return 0;
+}
+
+
+/* cd_pause_h:
+ *  Pause playback.
+ */
+void cd_pause_h(cd_device *dev)
+{
+    uint64_t t = _cd_stats_start(dev);
+    int ret;
+
+    lock(dev);
+    ret = dev->driver->pause(dev);
+    poll_status(dev);
+    unlock(dev);
+    _cd_stats_end(dev, STAT_PAUSE, t, ret != 0);
+}
+
+
+/* cd_resume_h:
+ *  Resume playback.
+ */
+void cd_resume_h(cd_device *dev)
+{
+    uint64_t t = _cd_stats_start(dev);
+    int ret = 0;
+
+    lock(dev);
+    poll_status(dev);
+    if (dev->status.audiostatus == CDROM_AUDIO_PAUSED) {
+	ret = dev->driver->resume(dev);
+	if (ret == 0)
+	    publish_status(dev, CDROM_AUDIO_PLAY, dev->status.track,
+			   dev->status.lba);
+    }
+    unlock(dev);
+    _cd_stats_end(dev, STAT_RESUME, t, ret != 0);
+}
+
+
+/* cd_is_paused_h:
+ *  Return non-zero if playback is paused.
+ */
+int cd_is_paused_h(cd_device *dev)
+{
+    uint64_t t = _cd_stats_start(dev);
+    Status st;
+
+    get_status(dev, &st);
+    _cd_stats_end(dev, STAT_IS_PAUSED, t, 0);
+    return (st.audiostatus == CDROM_AUDIO_PAUSED);
+}
+
+
+static void lba_to_position(int lba, int *m, int *s, int *f)
+{
+    lba = MAX(0, lba);
+    *m = lba / (CD_SECS * CD_FRAMES);
+    *s = (lba / CD_FRAMES) % CD_SECS;
+    *f = lba % CD_FRAMES;
+}
+
+
+/* cd_get_position_h:
+ *  Fill in POS with where playback has got to.  Return the track
+ *  playing or paused, or zero if stopped.
+ */
+int cd_get_position_h(cd_device *dev, cd_position *pos)
+{
+    uint64_t t = _cd_stats_start(dev);
+    Status st;
+    int lba;
+
+    get_status(dev, &st);
+
+    /* Don't run into the next track if we couldn't check with the
+     * drive that it got there. */
+    lba = status_lba(&st, get_msecs());
+    if (st.track_end >= 0)
+	lba = MIN(lba, st.track_end - 1);
+
+    memset(pos, 0, sizeof(cd_position));
+    if ((st.audiostatus == CDROM_AUDIO_PLAY) ||
+	(st.audiostatus == CDROM_AUDIO_PAUSED)) {
+	pos->track = st.track;
+	pos->paused = (st.audiostatus == CDROM_AUDIO_PAUSED);
+	pos->abs_lba = lba;
+	pos->rel_lba = lba - st.track_start;
+	lba_to_position(lba + CD_MSF_OFFSET,
+			&pos->abs_min, &pos->abs_sec, &pos->abs_frame);
+	lba_to_position(pos->rel_lba,
+			&pos->rel_min, &pos->rel_sec, &pos->rel_frame);
+    }
+
+    _cd_stats_end(dev, STAT_GET_POSITION, t, 0);
+    return pos->track;
+}
+
+
+/* cd_stop_h:
+ *  Stop playback.
+ */
+void cd_stop_h(cd_device *dev)
+{
+    uint64_t t = _cd_stats_start(dev);
+    int ret;
+
+    lock(dev);
+    ret = dev->driver->stop(dev);
+    if (ret == 0)
+	publish_status(dev, CDROM_AUDIO_NO_STATUS, 0, 0);
+    unlock(dev);
+    _cd_stats_end(dev, STAT_STOP, t, ret != 0);
+}
+
+
+/* cd_get_tracks_h:
+ *  Get first and last tracks of CD.  Return zero on success.
+ */
+int cd_get_tracks_h(cd_device *dev, int *first, int *last)
+{
+    uint64_t t = _cd_stats_start(dev);
+    int ret;
+
+    lock(dev);
+    ret = update_toc(dev);
+    if (first) *first = (ret == 0) ? dev->first_track : 0;
+    if (last)  *last  = (ret == 0) ? dev->last_track : 0;
+    unlock(dev);
+    _cd_stats_end(dev, STAT_GET_TRACKS, t, ret != 0);
+    return ret;
+}
+
+
+/* cd_is_audio_h:
+ *  Return 1 if track specified is audio,
+ *  zero if it is data, -1 if an error occurs.
+ */
+int cd_is_audio_h(cd_device *dev, int track)
+{
+    uint64_t t = _cd_stats_start(dev);
+    int ret = -1;
+
+    lock(dev);
+    if ((update_toc(dev) == 0) && valid_track(dev, track))
+	ret = (dev->tracks[track].ctrl & CDROM_DATA_TRACK) ? 0 : 1;
+    unlock(dev);
+    _cd_stats_end(dev, STAT_IS_AUDIO, t, ret < 0);
+    return ret;
+}
+
+
+/* _cd_track_bounds:
+ *  Put the LBA where TRACK starts in START and the one following its
+ *  end in END.  Return 1 if it is audio, zero if it is data, -1 if an
+ *  error occurs.
+ */
+int _cd_track_bounds(cd_device *dev, int track, int *start, int *end)
+{
+    int ret = -1;
+
+    lock(dev);
+    if ((update_toc(dev) == 0) && valid_track(dev, track)) {
+	*start = dev->tracks[track].lba;
+	*end = track_end(dev, track);
+	ret = (dev->tracks[track].ctrl & CDROM_DATA_TRACK) ? 0 : 1;
+    }
+    unlock(dev);
+    return ret;
+}
+
+
+/* cd_get_layout_h:
+ *  Fill in LAYOUT with every track on the disc in DEV.  Return zero on
+ *  success.
+ */
+int cd_get_layout_h(cd_device *dev, cd_layout *layout)
+{
+    uint64_t t0 = _cd_stats_start(dev);
+    cd_layout_track *lt;
+    int t, ctrl, ret;
+
+    memset(layout, 0, sizeof(cd_layout));
+
+    lock(dev);
+
+    ret = update_toc(dev);
+    if (ret == 0) {
+	layout->first = dev->first_track;
+	layout->last = dev->last_track;
+	layout->leadout = dev->tracks[0].lba;
+	layout->unverified = dev->toc_unverified;
+
+	for (t = dev->first_track; t <= dev->last_track; t++) {
+	    lt = &layout->track[t];
+	    ctrl = dev->tracks[t].ctrl;
+	    lt->lba = dev->tracks[t].lba;
+	    lt->length = track_end(dev, t) - lt->lba;
+	    lt->audio = !(ctrl & CDROM_DATA_TRACK);
+	    lt->preemphasis = (ctrl & 0x01) != 0;
+	    lt->copy = (ctrl & 0x02) != 0;
+	}
+    }
+
+    unlock(dev);
+    _cd_stats_end(dev, STAT_GET_LAYOUT, t0, ret != 0);
+    return ret;
+}
+
+
+/* _cd_get_toc:
+ *  Copy the TOC into FIRST, LAST and TRACKS (which holds CDROM_LEADOUT
+ *  + 1, with the leadout at TRACKS[0]), reading it only if the disc has
+ *  changed.  UNVERIFIED is set if the tracks came from the cache on a
+ *  header match.  Return zero on success.
+ */
+int _cd_get_toc(cd_device *dev, int *first, int *last, Track *tracks,
+		int *unverified)
+{
+    int ret;
+
+    lock(dev);
+    ret = update_toc(dev);
+    if (ret == 0) {
+	*first = dev->first_track;
+	*last = dev->last_track;
+	*unverified = dev->toc_unverified;
+	tracks[0] = dev->tracks[0];
+	memcpy(&tracks[*first], &dev->tracks[*first],
+	       (*last - *first + 1) * sizeof(Track));
+    }
+    unlock(dev);
+    return ret;
+}
+
+
+/* cd_get_volume_h:
+ *  Return volumes of left and right channels.  If the drive can't say,
+ *  return the volume used for extracted audio.
+ */
+void cd_get_volume_h(cd_device *dev, int *c0, int *c1)
+{
+    uint64_t t = _cd_stats_start(dev);
+    int v0, v1, ret;
+
+    lock(dev);
+    ret = dev->driver->get_volume(dev, &v0, &v1);
+    if (ret != 0) {
+	v0 = dev->volume & 0xff;
+	v1 = (dev->volume >> 8) & 0xff;
+    }
+    unlock(dev);
+    _cd_stats_end(dev, STAT_GET_VOLUME, t, ret != 0);
+    if (c0) *c0 = v0;
+    if (c1) *c1 = v1;
+}
+
+
+/* cd_set_volume_h:
+ *  Set left and right channel volumes (0 - 255), of the drive's own
+ *  output and of audio read through streams.
+ */
+void cd_set_volume_h(cd_device *dev, int c0, int c1)
+{
+    uint64_t t = _cd_stats_start(dev);
+    int ret;
+
+    c0 = MID(0, c0, 255);
+    c1 = MID(0, c1, 255);
+
+    lock(dev);
+    __atomic_store_n(&dev->volume, c0 | (c1 << 8), __ATOMIC_RELAXED);
+    ret = dev->driver->set_volume(dev, c0, c1);
+    unlock(dev);
+    _cd_stats_end(dev, STAT_SET_VOLUME, t, ret != 0);
+}
+
+
+/* cd_eject_h:
+ *  Eject CD drive (if possible).
+ */
+void cd_eject_h(cd_device *dev)
+{
+    uint64_t t = _cd_stats_start(dev);
+    int ret;
+
+    lock(dev);
+    ret = dev->driver->eject(dev);
+    dev->toc_valid = 0;
+    publish_status(dev, CDROM_AUDIO_NO_STATUS, 0, 0);
+    unlock(dev);
+    _cd_stats_end(dev, STAT_EJECT, t, ret != 0);
+}
+
+
+/* cd_close_h:
+ *  Close CD drive (if possible).
+ */
+void cd_close_h(cd_device *dev)
+{
+    uint64_t t = _cd_stats_start(dev);
+    int ret;
+
+    lock(dev);
+    ret = dev->driver->close_tray(dev);
+    dev->toc_valid = 0;
+    unlock(dev);
+    _cd_stats_end(dev, STAT_CLOSE, t, ret != 0);
+}
+
+
+/* tune_batch:
+ *  A read of N frames took ELAPSED seconds.  Grow the batch size while
+ *  that keeps improving throughput.
+ */
+static void tune_batch(cd_device *dev, int n, double elapsed)
+{
+    double rate;
+
+    if ((dev->batch_tuned) || (n != dev->batch) || (elapsed <= 0))
+	return;
+
+    rate = n / elapsed;
+    if (rate < dev->batch_rate * (100 + BATCH_GAIN) / 100) {
+	/* No better than half the size: go back to it and stay. */
+	if (dev->batch > MIN_READ_FRAMES)
+	    dev->batch /= 2;
+	dev->batch_tuned = 1;
+	return;
+    }
+
+    dev->batch_rate = rate;
+    if (dev->batch * 2 <= dev->batch_max)
+	dev->batch *= 2;
+    else {
+	dev->batch = dev->batch_max;
+	dev->batch_tuned = 1;
+    }
+}
+
+
+/* shrink_batch:
+ *  The drive refused a read of N frames.  Return non-zero if it is
+ *  worth retrying with a smaller one.
+ */
+static int shrink_batch(cd_device *dev, int n)
+{
+    if ((n <= 1) ||
+	((errno != EIO) && (errno != ENOMEM) && (errno != EINVAL)))
+	return 0;
+
+    dev->batch_max = n / 2;
+    dev->batch = MIN(dev->batch, dev->batch_max);
+    dev->batch_rate = 0;
+    return 1;
+}
+
+
+/* _cd_read_batch:
+ *  Make one read request of up to NFRAMES frames at LBA into BUF, no
+ *  more than the current batch size.  Return the number of frames read,
+ *  zero if the batch size was reduced and the caller should try again,
+ *  or -1 on error.  Call with the lock held.
+ */
+int _cd_read_batch(cd_device *dev, int lba, int nframes, unsigned char *buf)
+{
+    double t;
+    int n;
+
+    n = MIN(nframes, dev->batch);
+
+    t = get_secs();
+    if (dev->driver->read_audio(dev, lba, n, buf) < 0)
+	return shrink_batch(dev, n) ? 0 : -1;
+    t = get_secs() - t;
+
+    /* The first read after a seek says nothing about throughput.  Going
+     * back a little (to overlap for jitter correction) is no seek. */
+    if ((lba <= dev->next_lba) &&
+	(lba >= dev->next_lba - JITTER_OVERLAP - JITTER_TAIL))
+	tune_batch(dev, n, t);
+    dev->next_lba = lba + n;
+
+    return n;
+}
+
+
+/* read_audio:
+ *  Read NFRAMES raw frames at LBA into BUF, in as few requests as the
+ *  drive allows.  The lock is dropped between requests so other
+ *  commands can get in.  Return zero on success.
+ */
+static int read_audio(cd_device *dev, int lba, int nframes, unsigned char *buf)
+{
+    int n;
+
+    while (nframes > 0) {
+	lock(dev);
+	if (dev->jitter)
+	    n = _cd_jitter_read(dev, lba, nframes, buf);
+	else
+	    n = _cd_read_batch(dev, lba, nframes, buf);
+	if (n > 0)
+	    _cd_checksum_update(dev, lba, n, buf);
+	unlock(dev);
+
+	if (n < 0)
+	    return -1;
+
+	lba += n;
+	nframes -= n;
+	buf += n * CD_FRAMESIZE_RAW;
+    }
+
+    return 0;
+}
+
+
+/* cd_read_audio:
+ *  Read NFRAMES raw audio frames (CD_FRAMESIZE_RAW bytes each) starting
+ *  at LBA into BUF.  Return zero on success.
+ */
+int cd_read_audio(cd_device *dev, int lba, int nframes, void *buf)
+{
+    uint64_t t = _cd_stats_start(dev);
+    int leadout, ret;
+
+    lock(dev);
+    ret = update_toc(dev);
+    leadout = dev->tracks[0].lba;
+    unlock(dev);
+
+    if ((ret == 0) &&
+	((lba < 0) || (nframes < 0) || (lba + nframes > leadout))) {
+	_cd_set_error(CDERR_BAD_ARG, "Frames out of range");
+	ret = -1;
+    }
+
+    if (ret == 0)
+	ret = read_audio(dev, lba, nframes, buf);
+
+    _cd_stats_end(dev, STAT_READ_AUDIO, t, ret != 0);
+    return ret;
+}
+
+
+/* cd_map_audio:
+ *  Return a pointer to NFRAMES frames of audio at LBA, in the same form
+ *  cd_read_audio would give, without copying them.  Only disc images
+ *  can do this, and only within a run of frames from one file.  The
+ *  pointer is good until DEV is released.  Return NULL on error.
+ */
+const void *cd_map_audio(cd_device *dev, int lba, int nframes)
+{
+    uint64_t t = _cd_stats_start(dev);
+    const void *p = NULL;
+
+    lock(dev);
+
+    if (update_toc(dev) == 0) {
+	if ((lba < 0) || (nframes <= 0) ||
+	    (lba + nframes > dev->tracks[0].lba))
+	    _cd_set_error(CDERR_BAD_ARG, "Frames out of range");
+	else if (!dev->driver->map_audio)
+	    _cd_set_error(CDERR_UNSUPPORTED, "Driver cannot map audio");
+	else
+	    p = dev->driver->map_audio(dev, lba, nframes);
+    }
+
+    unlock(dev);
+    _cd_stats_end(dev, STAT_MAP_AUDIO, t, p == NULL);
+    return p;
+}
+
+
+/* cd_get_read_batch:
+ *  Return the number of frames per read request that extraction has
+ *  settled on so far.
+ */
+int cd_get_read_batch(cd_device *dev)
+{
+    int n;
+
+    lock(dev);
+    n = dev->batch;
+    unlock(dev);
+    return n;
+}
+
+
+/* make_span:
+ *  Make a span for tracks FIRST to LAST, which must be audio.  Return
+ *  NULL on error.
+ */
+static Span *make_span(cd_device *dev, int first, int last)
+{
+    Span *sp;
+    int i;
+
+    lock(dev);
+
+    if ((update_toc(dev) != 0) ||
+	!valid_track(dev, first) || !valid_track(dev, last)) {
+	unlock(dev);
+	return NULL;
+    }
+
+    for (i = first; i <= last; i++) {
+	if (dev->tracks[i].ctrl & CDROM_DATA_TRACK) {
+	    _cd_set_error(CDERR_NOT_AUDIO, "Not an audio track");
+	    unlock(dev);
+	    return NULL;
+	}
+    }
+
+    sp = malloc(sizeof(Span) + (last - first + 2) * sizeof(int));
+    if (!sp) {
+	_cd_copy_error();
+	unlock(dev);
+	return NULL;
+    }
+
+    sp->first = first;
+    sp->last = last;
+    for (i = first; i <= last; i++)
+	sp->lba[i - first] = dev->tracks[i].lba;
+    sp->lba[last - first + 1] = track_end(dev, last);
+    sp->offset = 0;
+    sp->length = track_end(dev, last) - dev->tracks[first].lba;
+    sp->next = NULL;
+
+    unlock(dev);
+    return sp;
+}
+
+
+/* find_span:
+ *  Return the span holding frame POS of S, which must be in the stream.
+ */
+static Span *find_span(cd_stream *s, int pos)
+{
+    Span *sp = s->spans;
+
+    while (pos >= sp->offset + sp->length)
+	sp = __atomic_load_n(&sp->next, __ATOMIC_ACQUIRE);
+
+    return sp;
+}
+
+
+/* _cd_stream_locate:
+ *  Return the LBA of frame POS of S, and in LEFT the number of frames
+ *  from there to the end of its span.  POS must be in the stream.
+ */
+int _cd_stream_locate(cd_stream *s, int pos, int *left)
+{
+    Span *sp = find_span(s, pos);
+
+    *left = sp->offset + sp->length - pos;
+    return sp->lba[0] + pos - sp->offset;
+}
+
+
+/* cd_stream_open:
+ *  Open a stream for reading the audio of tracks FIRST to LAST in
+ *  order.  Return NULL on error.
+ */
+cd_stream *cd_stream_open(cd_device *dev, int first, int last)
+{
+    uint64_t t = _cd_stats_start(dev);
+    cd_stream *s = NULL;
+    Span *sp;
+
+    sp = make_span(dev, first, last);
+    if (sp) {
+	s = malloc(sizeof(cd_stream));
+	if (!s) {
+	    _cd_copy_error();
+	    free(sp);
+	}
+    }
+
+    if (s) {
+	s->dev = dev;
+	s->spans = s->last_span = sp;
+	s->length = sp->length;
+	s->pos = 0;
+	s->ra = NULL;
+	s->rate = CD_SAMPLE_RATE;
+	s->format = CD_FORMAT_S16;
+	_cd_gain_init(s);
+    }
+
+    _cd_stats_end(dev, STAT_STREAM_OPEN, t, !s);
+    return s;
+}
+
+
+/* cd_stream_queue:
+ *  Add tracks FIRST to LAST to the end of the stream.  Reading runs on
+ *  into them without a break, and readahead fetches them before the
+ *  stream gets there.  Return zero on success.
+ */
+int cd_stream_queue(cd_stream *s, int first, int last)
+{
+    uint64_t t = _cd_stats_start(s->dev);
+    Span *sp;
+
+    sp = make_span(s->dev, first, last);
+    if (!sp) {
+	_cd_stats_end(s->dev, STAT_STREAM_QUEUE, t, 1);
+	return -1;
+    }
+
+    /* The readahead thread may be walking the spans: link the new one
+     * in before making the stream longer. */
+    sp->offset = s->length;
+    __atomic_store_n(&s->last_span->next, sp, __ATOMIC_RELEASE);
+    s->last_span = sp;
+    __atomic_store_n(&s->length, sp->offset + sp->length, __ATOMIC_RELEASE);
+
+    _cd_stats_end(s->dev, STAT_STREAM_QUEUE, t, 0);
+    return 0;
+}
+
+
+/* cd_stream_close:
+ *  Free a stream.  The drive stays open.
+ */
+void cd_stream_close(cd_stream *s)
+{
+    Span *sp, *next;
+
+    _cd_readahead_stop(s);
+
+    for (sp = s->spans; sp; sp = next) {
+	next = sp->next;
+	free(sp);
+    }
+
+    free(s);
+}
+
+
+/* cd_stream_read:
+ *  Read up to NFRAMES frames from the stream into BUF.  Return the 
+ *  number of frames read, zero at the end of the stream, or -1 on
+ *  error.
+ */
+int cd_stream_read(cd_stream *s, void *buf, int nframes)
+{
+    uint64_t t = _cd_stats_start(s->dev);
+    unsigned char *p = buf;
+    int lba, left, n, got = 0;
+
+    if (s->ra) {
+	_cd_set_error(CDERR_BUSY, "Stream is reading ahead");
+	got = -1;
+    }
+    else
+	nframes = MIN(nframes, s->length - s->pos);
+
+    /* A span at a time, so a read can run on into the next. */
+    while ((got >= 0) && (got < nframes)) {
+	lba = _cd_stream_locate(s, s->pos, &left);
+	n = MIN(nframes - got, left);
+
+	if (read_audio(s->dev, lba, n, p) != 0) {
+	    if (got == 0)
+		got = -1;
+	    break;
+	}
+
+	_cd_apply_gain(s, p, n * CD_FRAME_SAMPLES, CD_FORMAT_S16);
+	s->pos += n;
+	got += n;
+	p += n * CD_FRAME_BYTES;
+    }
+
+    _cd_stats_end(s->dev, STAT_STREAM_READ, t, got < 0);
+    return got;
+}
+
+
+/* cd_stream_seek:
+ *  Move to frame POS, relative to the start of the stream.  Return
+ *  zero on success.
+ */
+int cd_stream_seek(cd_stream *s, int pos)
+{
+    uint64_t t = _cd_stats_start(s->dev);
+    int ret = 0;
+
+    if ((pos < 0) || (pos > s->length)) {
+	_cd_set_error(CDERR_BAD_ARG, "Frames out of range");
+	ret = -1;
+    }
+    else {
+	s->pos = pos;
+	if (s->ra)
+	    ret = _cd_readahead_restart(s);
+    }
+
+    _cd_stats_end(s->dev, STAT_STREAM_SEEK, t, ret != 0);
+    return ret;
+}
+
+
+/* cd_stream_tell:
+ *  Return the current frame, relative to the start of the stream.
+ */
+int cd_stream_tell(cd_stream *s)
+{
+    if (s->ra)
+	return MIN(_cd_readahead_tell(s), s->length);
+
+    return s->pos;
+}
+
+
+/* cd_stream_length:
+ *  Return the length of the stream in frames, including what has been
+ *  queued.
+ */
+int cd_stream_length(cd_stream *s)
+{
+    return s->length;
+}
+
+
+/* cd_stream_track:
+ *  Return the track at the current position of the stream, or zero at
+ *  the end.
+ */
+int cd_stream_track(cd_stream *s)
+{
+    int pos = cd_stream_tell(s);
+    Span *sp;
+    int lba, t;
+
+    if (pos >= s->length)
+	return 0;
+
+    sp = find_span(s, pos);
+    lba = sp->lba[0] + pos - sp->offset;
+
+    for (t = sp->last; (t > sp->first) && (sp->lba[t - sp->first] > lba); t--)
+	;
+
+    return t;
+}
+
+
+/* The original interface, working on the default device. */
+
+int cd_play(int track)
+{
+    if (no_default_dev())
+	return -1;
+
+    return cd_play_h(default_dev, track);
+}
+
+
+int cd_play_range(int start, int end)
+{
+    if (no_default_dev())
+	return -1;
+
+    return cd_play_range_h(default_dev, start, end);
+}
+
+
+int cd_play_from(int track)
+{
+    if (no_default_dev())
+	return -1;
+
+    return cd_play_from_h(default_dev, track);
+}
+
+
+int cd_current_track()
+{
+    if (no_default_dev())
+	return 0;
+
+    return cd_current_track_h(default_dev);
+}
+
+
+int cd_is_ready()
+{
+    if (no_default_dev())
+	return -1;
+
+    return cd_is_ready_h(default_dev);
+}
+
+
+void cd_pause()
+{
+    if (no_default_dev())
+	return;
+
+    cd_pause_h(default_dev);
+}
+
+
+void cd_resume()
+{
+    if (no_default_dev())
+	return;
+
+    cd_resume_h(default_dev);
+}
+
+
+int cd_is_paused()
+{
+    if (no_default_dev())
+	return 0;
+
+    return cd_is_paused_h(default_dev);
+}
+
+
+int cd_get_position(cd_position *pos)
+{
+    if (no_default_dev()) {
+	memset(pos, 0, sizeof(cd_position));
+	return 0;
+    }
+
+    return cd_get_position_h(default_dev, pos);
+}
+
+
+void cd_stop()
+{
+    if (no_default_dev())
+	return;
+
+    cd_stop_h(default_dev);
+}
+
+
+int cd_get_layout(cd_layout *layout)
+{
+    if (no_default_dev()) {
+	memset(layout, 0, sizeof(cd_layout));
+	return -1;
+    }
+
+    return cd_get_layout_h(default_dev, layout);
+}
+
+
+int cd_get_tracks(int *first, int *last)
+{
+    if (no_default_dev())
+	return -1;
+
+    return cd_get_tracks_h(default_dev, first, last);
+}
+
+
+int cd_is_audio(int track)
+{
+    if (no_default_dev())
+	return -1;
+
+    return cd_is_audio_h(default_dev, track);
+}
+
+
+void cd_get_volume(int *c0, int *c1)
+{
+    if (no_default_dev()) {
+	if (c0) *c0 = 0;
+	if (c1) *c1 = 0;
+	return;
+    }
+
+    cd_get_volume_h(default_dev, c0, c1);
+}
+
+
+void cd_set_volume(int c0, int c1)
+{
+    if (no_default_dev())
+	return;
+
+    cd_set_volume_h(default_dev, c0, c1);
+}
+
+
+void cd_eject()
+{
+    if (no_default_dev())
+	return;
+
+    cd_eject_h(default_dev);
+}
+
+
+void cd_close()
+{
+    if (no_default_dev())
+	return;
+
+    cd_close_h(default_dev);
 }
@@ -0,0 +1,436 @@
+/* libcda; Linux SG_IO driver.
+ *
+ * Talks MMC to the drive directly through SG_IO instead of using the
+ * cdrom driver's ioctls.  That lets us read more than 75 frames at a
+ * time and put a time limit on every command.
+ */
+
+#include <string.h>
+#include <limits.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <sys/ioctl.h>
+#include <linux/fs.h>
+#include <scsi/sg.h>
+#include "cdaint.h"
+
+
+/* If the block layer won't tell us how much it can transfer at once. */
+#define DEFAULT_READ_FRAMES	27
+
+#define SENSE_LEN		32
+
+
+/* sg_command:
+ *  Send the command block CDB to the drive, transferring LEN bytes of
+ *  data to or from BUF.  Return zero on success.
+ */
+static int sg_command(cd_device *dev, unsigned char *cdb, int cdb_len,
+		      int dir, void *buf, int len)
+{
+    unsigned char sense[SENSE_LEN];
+    sg_io_hdr_t io;
+    uint64_t t;
+    int key, asc, ret;
+
+    memset(&io, 0, sizeof io);
+    memset(sense, 0, sizeof sense);
+    io.interface_id = 'S';
+    io.cmdp = cdb;
+    io.cmd_len = cdb_len;
+    io.dxfer_direction = (len > 0) ? dir : SG_DXFER_NONE;
+    io.dxferp = buf;
+    io.dxfer_len = len;
+    io.sbp = sense;
+    io.mx_sb_len = sizeof sense;
+    io.timeout = dev->timeout;
+
+    t = _cd_stats_start(dev);
+    ret = ioctl(dev->fd, SG_IO, &io);
+    _cd_stats_end(dev, STAT_SG_IO, t, ret < 0);
+    if (ret < 0) {
+	_cd_copy_error();
+	return -1;
+    }
+
+    if ((io.info & SG_INFO_OK_MASK) == SG_INFO_OK)
+	return 0;
+
+    /* DID_TIME_OUT */
+    if (io.host_status == 0x03) {
+	errno = ETIMEDOUT;
+	_cd_copy_error();
+	return -1;
+    }
+
+    key = (io.sb_len_wr > 2) ? (sense[2] & 0x0f) : 0;
+    asc = (io.sb_len_wr > 12) ? sense[12] : 0;
+
+    if ((key == 0x02) && (asc == 0x3a)) {
+	errno = ENOMEDIUM;
+	_cd_copy_error();
+    }
+    else if ((key == 0x05) || (key == 0x0b)) {
+	/* ILLEGAL REQUEST (e.g. transfer too long), ABORTED COMMAND */
+	errno = EINVAL;
+	_cd_copy_error();
+    }
+    else if (key == 0x06) {
+	/* UNIT ATTENTION: the disc was probably changed. */
+	errno = EAGAIN;
+	_cd_copy_error();
+    }
+    else {
+	errno = EIO;
+	_cd_copy_error();
+    }
+
+    return -1;
+}
+
+
+static void put_lba(unsigned char *p, int lba)
+{
+    p[0] = (lba >> 24) & 0xff;
+    p[1] = (lba >> 16) & 0xff;
+    p[2] = (lba >> 8) & 0xff;
+    p[3] = lba & 0xff;
+}
+
+
+static int get_lba(unsigned char *p)
+{
+    return (int)((p[0] << 24) | (p[1] << 16) | (p[2] << 8) | p[3]);
+}
+
+
+static void put_msf(unsigned char *p, int lba)
+{
+    lba += CD_MSF_OFFSET;
+    p[0] = lba / (CD_SECS * CD_FRAMES);
+    p[1] = (lba / CD_FRAMES) % CD_SECS;
+    p[2] = lba % CD_FRAMES;
+}
+
+
+static int sg_open(cd_device *dev, const char *path)
+{
+    int version;
+
+    dev->fd = open(path, O_RDONLY | O_NONBLOCK);
+    if (dev->fd < 0) {
+	_cd_copy_error();
+	return -1;
+    }
+
+    if ((ioctl(dev->fd, SG_GET_VERSION_NUM, &version) < 0) ||
+	(version < 30000)) {
+	_cd_set_error(CDERR_UNSUPPORTED, "SG_IO not supported by device");
+	close(dev->fd);
+	return -1;
+    }
+
+    return 0;
+}
+
+
+static void sg_close(cd_device *dev)
+{
+    close(dev->fd);
+}
+
+
+/* sg_read_toc:
+ *  READ TOC/PMA/ATIP, format 0, LBA addresses.
+ */
+static int sg_read_toc(cd_device *dev)
+{
+    unsigned char cdb[10];
+    unsigned char buf[4 + 8 * 100];
+    unsigned char *d;
+    int len, first, last, i, t;
+
+    memset(cdb, 0, sizeof cdb);
+    cdb[0] = 0x43;
+    cdb[7] = (sizeof buf) >> 8;
+    cdb[8] = (sizeof buf) & 0xff;
+
+    memset(buf, 0, sizeof buf);
+    if (sg_command(dev, cdb, sizeof cdb, SG_DXFER_FROM_DEV, buf, sizeof buf))
+	return -1;
+
+    len = MIN((buf[0] << 8) | buf[1], (int)sizeof buf - 2);
+    first = buf[2];
+    last = buf[3];
+    if ((first < 1) || (last > 99) || (first > last)) {
+	_cd_set_error(CDERR_IO, "Bad TOC");
+	return -1;
+    }
+
+    for (i = 0, d = buf + 4; d + 8 <= buf + 2 + len; i++, d += 8) {
+	t = d[2];
+	if (t == CDROM_LEADOUT) {
+	    dev->tracks[0].ctrl = CDROM_DATA_TRACK;
+	    dev->tracks[0].lba = get_lba(d + 4);
+	}
+	else if ((t >= first) && (t <= last)) {
+	    dev->tracks[t].ctrl = d[1] & 0x0f;
+	    dev->tracks[t].lba = get_lba(d + 4);
+	}
+    }
+
+    dev->first_track = first;
+    dev->last_track = last;
+    return 0;
+}
+
+
+/* sg_media_changed:
+ *  Ask the cdrom driver first, like the ioctl driver does: its event
+ *  polling takes the unit attention for a new disc before we would see
+ *  it, but remembers the change for CDROM_MEDIA_CHANGED.  That fails
+ *  on an sg node, so then TEST UNIT READY; not ready or a unit
+ *  attention means the disc was changed.
+ */
+static int sg_media_changed(cd_device *dev)
+{
+    unsigned char cdb[6];
+    uint64_t t;
+    int ret;
+
+    t = _cd_stats_start(dev);
+    ret = ioctl(dev->fd, CDROM_MEDIA_CHANGED, CDSL_CURRENT);
+    _cd_stats_end(dev, STAT_MEDIA_CHANGED, t, ret < 0);
+    if (ret > 0)
+	return 1;
+
+    memset(cdb, 0, sizeof cdb);
+    if (sg_command(dev, cdb, sizeof cdb, SG_DXFER_NONE, NULL, 0) == 0)
+	return 0;
+
+    /* Not ready, no disc or changed: the TOC is no good either way. */
+    return (errno != ETIMEDOUT);
+}
+
+
+static int sg_max_read_frames(cd_device *dev)
+{
+    unsigned short sectors;
+
+    if ((ioctl(dev->fd, BLKSECTGET, &sectors) < 0) ||
+	(sectors * 512 < CD_FRAMESIZE_RAW))
+	return DEFAULT_READ_FRAMES;
+
+    return sectors * 512 / CD_FRAMESIZE_RAW;
+}
+
+
+/* sg_read_audio:
+ *  READ CD, sector type CD-DA, user data only.
+ */
+static int sg_read_audio(cd_device *dev, int lba, int nframes,
+			 unsigned char *buf)
+{
+    unsigned char cdb[12];
+
+    memset(cdb, 0, sizeof cdb);
+    cdb[0] = 0xbe;
+    cdb[1] = 0x04;
+    put_lba(cdb + 2, lba);
+    cdb[6] = (nframes >> 16) & 0xff;
+    cdb[7] = (nframes >> 8) & 0xff;
+    cdb[8] = nframes & 0xff;
+    cdb[9] = 0x10;
+
+    return sg_command(dev, cdb, sizeof cdb, SG_DXFER_FROM_DEV,
+		      buf, nframes * CD_FRAMESIZE_RAW);
+}
+
+
+/* sg_play:
+ *  PLAY AUDIO MSF.
+ */
+static int sg_play(cd_device *dev, int lba0, int lba1)
+{
+    unsigned char cdb[10];
+
+    memset(cdb, 0, sizeof cdb);
+    cdb[0] = 0x47;
+    put_msf(cdb + 3, lba0);
+    put_msf(cdb + 6, lba1);
+
+    return sg_command(dev, cdb, sizeof cdb, SG_DXFER_NONE, NULL, 0);
+}
+
+
+/* pause_resume:
+ *  PAUSE/RESUME.
+ */
+static int pause_resume(cd_device *dev, int resume)
+{
+    unsigned char cdb[10];
+
+    memset(cdb, 0, sizeof cdb);
+    cdb[0] = 0x4b;
+    cdb[8] = resume ? 1 : 0;
+
+    return sg_command(dev, cdb, sizeof cdb, SG_DXFER_NONE, NULL, 0);
+}
+
+
+static int sg_pause(cd_device *dev)
+{
+    return pause_resume(dev, 0);
+}
+
+
+static int sg_resume(cd_device *dev)
+{
+    return pause_resume(dev, 1);
+}
+
+
+/* sg_stop:
+ *  STOP PLAY/SCAN.
+ */
+static int sg_stop(cd_device *dev)
+{
+    unsigned char cdb[10];
+
+    memset(cdb, 0, sizeof cdb);
+    cdb[0] = 0x4e;
+
+    return sg_command(dev, cdb, sizeof cdb, SG_DXFER_NONE, NULL, 0);
+}
+
+
+/* start_stop:
+ *  START STOP UNIT with the load/eject bit set.
+ */
+static int start_stop(cd_device *dev, int load)
+{
+    unsigned char cdb[6];
+
+    memset(cdb, 0, sizeof cdb);
+    cdb[0] = 0x1b;
+    cdb[4] = load ? 0x03 : 0x02;
+
+    return sg_command(dev, cdb, sizeof cdb, SG_DXFER_NONE, NULL, 0);
+}
+
+
+static int sg_eject(cd_device *dev)
+{
+    return start_stop(dev, 0);
+}
+
+
+static int sg_close_tray(cd_device *dev)
+{
+    return start_stop(dev, 1);
+}
+
+
+/* sg_get_subchnl:
+ *  READ SUB-CHANNEL, current position, LBA addresses.
+ */
+static int sg_get_subchnl(cd_device *dev, Subchnl *s)
+{
+    unsigned char cdb[10];
+    unsigned char buf[16];
+
+    memset(cdb, 0, sizeof cdb);
+    cdb[0] = 0x42;
+    cdb[2] = 0x40;
+    cdb[3] = 0x01;
+    cdb[8] = sizeof buf;
+
+    memset(buf, 0, sizeof buf);
+    if (sg_command(dev, cdb, sizeof cdb, SG_DXFER_FROM_DEV, buf, sizeof buf))
+	return -1;
+
+    /* MMC audio status codes are the ones in cdrom.h. */
+    s->audiostatus = buf[1];
+    s->track = buf[6];
+    s->abs_lba = get_lba(buf + 8);
+    s->rel_lba = get_lba(buf + 12);
+    return 0;
+}
+
+
+/* mode_sense_audio:
+ *  MODE SENSE(10) of the CD audio control page into BUF (24 bytes).
+ *  The port volumes are at BUF[17] and BUF[19].
+ */
+static int mode_sense_audio(cd_device *dev, unsigned char *buf)
+{
+    unsigned char cdb[10];
+
+    memset(cdb, 0, sizeof cdb);
+    cdb[0] = 0x5a;
+    cdb[1] = 0x08;		/* no block descriptors */
+    cdb[2] = 0x0e;
+    cdb[8] = 24;
+
+    memset(buf, 0, 24);
+    return sg_command(dev, cdb, sizeof cdb, SG_DXFER_FROM_DEV, buf, 24);
+}
+
+
+static int sg_get_volume(cd_device *dev, int *c0, int *c1)
+{
+    unsigned char buf[24];
+
+    if (mode_sense_audio(dev, buf) != 0)
+	return -1;
+
+    *c0 = buf[8 + 9];
+    *c1 = buf[8 + 11];
+    return 0;
+}
+
+
+static int sg_set_volume(cd_device *dev, int c0, int c1)
+{
+    unsigned char cdb[10];
+    unsigned char buf[24];
+
+    if (mode_sense_audio(dev, buf) != 0)
+	return -1;
+
+    /* The mode data length is reserved for MODE SELECT. */
+    buf[0] = buf[1] = 0;
+    buf[8] &= 0x3f;
+    buf[8 + 9] = c0;
+    buf[8 + 11] = c1;
+
+    memset(cdb, 0, sizeof cdb);
+    cdb[0] = 0x55;
+    cdb[1] = 0x10;		/* page format */
+    cdb[8] = sizeof buf;
+
+    return sg_command(dev, cdb, sizeof cdb, SG_DXFER_TO_DEV, buf, sizeof buf);
+}
+
+
+const Driver _cd_driver_sg = {
+    "sg",
+    sg_open,
+    sg_close,
+    sg_read_toc,
+    sg_media_changed,
+    sg_max_read_frames,
+    sg_read_audio,
+    sg_play,
+    sg_pause,
+    sg_resume,
+    sg_stop,
+    sg_get_subchnl,
+    sg_get_volume,
+    sg_set_volume,
+    sg_eject,
+    sg_close_tray,
+    NULL,
+    NULL
+};
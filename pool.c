@@ -0,0 +1,216 @@
+/* libcda; worker pool for the Linux component.
+ *
+ * A fixed set of threads runs jobs handed to it by ripping (see
+ * rip.c).  Each worker has its own queue; jobs are dealt out to the
+ * queues in turn, a worker takes the oldest job from its own queue, and
+ * a worker with nothing to do steals the newest job from another's.  So
+ * jobs mostly run in the order they were dealt out, and no worker sits
+ * idle while there is work anywhere.
+ *
+ * Jobs are queued and taken under the pool's lock, so a worker which
+ * wakes up either gets a job or goes back to sleep on the condition;
+ * it never spins waiting for one.  The lock is only held to link or
+ * unlink a job, which costs nothing next to running one.
+ */
+
+#include <stdlib.h>
+#include <unistd.h>
+#include "cdaint.h"
+
+
+typedef struct {
+    Job *head, *tail;
+} Deque;
+
+
+struct Worker {
+    struct Pool *pool;
+    int index;
+    pthread_t thread;
+};
+
+
+struct Pool {
+    int nthreads;
+    struct Worker *workers;
+    Deque *queues;
+    unsigned int next;		/* queue for the next job */
+
+    pthread_mutex_t lock;	/* for the queues, and sleeping */
+    pthread_cond_t cond;
+    int quit;
+};
+
+
+static void push_back(Deque *q, Job *job)
+{
+    job->next = NULL;
+    job->prev = q->tail;
+    if (q->tail)
+	q->tail->next = job;
+    else
+	q->head = job;
+    q->tail = job;
+}
+
+
+/* take:
+ *  Remove the oldest job from Q, or the newest if NEWEST.  Return NULL
+ *  if Q is empty.
+ */
+static Job *take(Deque *q, int newest)
+{
+    Job *job;
+
+    job = (newest) ? q->tail : q->head;
+    if (job) {
+	if (job->prev)
+	    job->prev->next = job->next;
+	else
+	    q->head = job->next;
+	if (job->next)
+	    job->next->prev = job->prev;
+	else
+	    q->tail = job->prev;
+    }
+
+    return job;
+}
+
+
+/* find_job:
+ *  Return a job for worker W from its own queue, or stolen from another,
+ *  or NULL if there are none.  Call with the pool's lock held.
+ */
+static Job *find_job(struct Worker *w)
+{
+    struct Pool *pool = w->pool;
+    Job *job;
+    int i;
+
+    job = take(&pool->queues[w->index], 0);
+
+    for (i = 1; !job && (i < pool->nthreads); i++)
+	job = take(&pool->queues[(w->index + i) % pool->nthreads], 1);
+
+    return job;
+}
+
+
+static void *worker(void *arg)
+{
+    struct Worker *w = arg;
+    struct Pool *pool = w->pool;
+    Job *job;
+
+    for (;;) {
+	pthread_mutex_lock(&pool->lock);
+	while (!(job = find_job(w)) && !pool->quit)
+	    pthread_cond_wait(&pool->cond, &pool->lock);
+	pthread_mutex_unlock(&pool->lock);
+
+	if (!job)
+	    break;
+
+	job->run(job);
+    }
+
+    return NULL;
+}
+
+
+/* _cd_pool_create:
+ *  Start a pool of NTHREADS workers, or one per CPU if NTHREADS is not
+ *  positive.  Return NULL on error.
+ */
+struct Pool *_cd_pool_create(int nthreads)
+{
+    struct Pool *pool;
+    int i;
+
+    if (nthreads <= 0)
+	nthreads = MAX(1, (int)sysconf(_SC_NPROCESSORS_ONLN));
+
+    pool = calloc(1, sizeof(struct Pool));
+    if (pool) {
+	pool->workers = calloc(nthreads, sizeof(struct Worker));
+	pool->queues = calloc(nthreads, sizeof(Deque));
+    }
+    if (!pool || !pool->workers || !pool->queues) {
+	_cd_copy_error();
+	if (pool) {
+	    free(pool->workers);
+	    free(pool->queues);
+	    free(pool);
+	}
+	return NULL;
+    }
+
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_cond_init(&pool->cond, NULL);
+
+    /* Workers look at NTHREADS as soon as they start. */
+    pthread_mutex_lock(&pool->lock);
+    for (i = 0; i < nthreads; i++) {
+	pool->workers[i].pool = pool;
+	pool->workers[i].index = i;
+	if (pthread_create(&pool->workers[i].thread, NULL, worker,
+			   &pool->workers[i]) != 0)
+	    break;
+	pool->nthreads = i + 1;
+    }
+    pthread_mutex_unlock(&pool->lock);
+
+    if (pool->nthreads == 0) {
+	_cd_set_error(CDERR_NO_MEMORY, "Cannot create thread");
+	_cd_pool_destroy(pool);
+	return NULL;
+    }
+
+    return pool;
+}
+
+
+/* _cd_pool_destroy:
+ *  Run whatever jobs are still queued, then stop the workers and free
+ *  POOL.
+ */
+void _cd_pool_destroy(struct Pool *pool)
+{
+    int i;
+
+    pthread_mutex_lock(&pool->lock);
+    pool->quit = 1;
+    pthread_cond_broadcast(&pool->cond);
+    pthread_mutex_unlock(&pool->lock);
+
+    for (i = 0; i < pool->nthreads; i++)
+	pthread_join(pool->workers[i].thread, NULL);
+
+    pthread_cond_destroy(&pool->cond);
+    pthread_mutex_destroy(&pool->lock);
+    free(pool->workers);
+    free(pool->queues);
+    free(pool);
+}
+
+
+/* _cd_pool_threads:
+ *  Return the number of workers in POOL.
+ */
+int _cd_pool_threads(struct Pool *pool)
+{
+    return pool->nthreads;
+}
+
+
+/* _cd_pool_submit:
+ *  Queue JOB to be run by one of the workers of POOL.
+ */
+void _cd_pool_submit(struct Pool *pool, Job *job)
+{
+    pthread_mutex_lock(&pool->lock);
+    push_back(&pool->queues[pool->next++ % pool->nthreads], job);
+    pthread_cond_signal(&pool->cond);
+    pthread_mutex_unlock(&pool->lock);
+}
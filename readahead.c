@@ -0,0 +1,463 @@
+/* libcda; stream readahead for the Linux component.
+ *
+ * A thread reads ahead of the application into a ring buffer.  The ring
+ * has exactly one producer (the thread) and one consumer (whoever calls
+ * cd_stream_pull), so it needs no lock: each side only writes its own
+ * counter.  Pulling never blocks, allocates or touches the drive, so it
+ * is safe to do from a real-time audio callback.
+ *
+ * If the stream was asked for another rate or format, the thread also
+ * does the conversion, a chunk at a time, so the consumer only copies.
+ *
+ * Tracks queued on the stream are read on into as soon as there is
+ * room, so the ring runs from one to the next without a gap however
+ * far apart they are on the disc.
+ */
+
+#include <string.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <time.h>
+#include <errno.h>
+#include "cdaint.h"
+
+
+/* Most frames read in one go, and the fewest worth waking up for. */
+#define CHUNK_FRAMES		CD_FRAMES
+#define MIN_CHUNK_FRAMES	4
+
+/* How long the thread sleeps when the ring is full (milliseconds). */
+#define FULL_SLEEP		10
+
+
+
+struct Readahead {
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    int quit;
+
+    unsigned char *ring;
+    int capacity;		/* samples; a multiple of CD_FRAME_SAMPLES
+				   unless converting */
+    int sample_bytes;
+    uint64_t head;		/* samples written; producer only */
+    uint64_t tail;		/* samples consumed; consumer only */
+
+    int start;			/* frame the thread started reading at */
+    int pos;			/* next frame to read; producer only */
+    int msecs;
+    int eof;
+
+    struct Resampler *rs;	/* NULL if not converting */
+    int16_t *in;		/* CD audio waiting to be converted */
+    unsigned char *out;		/* converted, waiting to go in the ring */
+    int flushed;
+    int error;
+    int error_code;
+    char error_str[256];
+};
+
+
+/* wait_quit:
+ *  Sleep for up to MSECS milliseconds, or until told to quit.  Return
+ *  non-zero if we should quit.
+ */
+static int wait_quit(struct Readahead *ra, int msecs)
+{
+    struct timespec ts;
+    int quit;
+
+    clock_gettime(CLOCK_REALTIME, &ts);
+    ts.tv_nsec += msecs * 1000000L;
+    ts.tv_sec += ts.tv_nsec / 1000000000L;
+    ts.tv_nsec %= 1000000000L;
+
+    pthread_mutex_lock(&ra->lock);
+    if (!ra->quit)
+	pthread_cond_timedwait(&ra->cond, &ra->lock, &ts);
+    quit = ra->quit;
+    pthread_mutex_unlock(&ra->lock);
+
+    return quit;
+}
+
+
+/* fail:
+ *  Remember the error cd_read_audio just set, for the consumer.
+ */
+static void fail(struct Readahead *ra)
+{
+    ra->error_code = cd_errno;
+    strncpy(ra->error_str, cd_error, sizeof ra->error_str);
+    ra->error_str[sizeof ra->error_str - 1] = 0;
+    __atomic_store_n(&ra->error, 1, __ATOMIC_RELEASE);
+}
+
+
+/* fill_direct:
+ *  Read straight into the ring, up to frame END of the stream.  Return
+ *  the number of samples added, or zero if there was no room or nothing
+ *  to read.
+ */
+static int fill_direct(cd_stream *s, struct Readahead *ra, uint64_t head,
+		       int nfree, int end)
+{
+    int idx, n, lba, left;
+
+    nfree /= CD_FRAME_SAMPLES;
+    if ((nfree < MIN_CHUNK_FRAMES) || (ra->pos >= end))
+	return 0;
+
+    /* Frames never wrap around the end of the ring, and reads never
+     * cross from one span to the next. */
+    lba = _cd_stream_locate(s, ra->pos, &left);
+    idx = head % ra->capacity;
+    n = MIN(nfree, (ra->capacity - idx) / CD_FRAME_SAMPLES);
+    n = MIN(n, CHUNK_FRAMES);
+    n = MIN(n, left);
+
+    if (cd_read_audio(s->dev, lba, n,
+		      ra->ring + idx * ra->sample_bytes) != 0) {
+	fail(ra);
+	return 0;
+    }
+
+    ra->pos += n;
+    return n * CD_FRAME_SAMPLES;
+}
+
+
+/* fill_converted:
+ *  Read a chunk, convert it, and copy it into the ring.  At frame END,
+ *  the end of the stream, flush what the resampler is holding back.
+ *  Return the number of samples added.
+ */
+static int fill_converted(cd_stream *s, struct Readahead *ra, uint64_t head,
+			  int nfree, int end)
+{
+    int idx, n, n1, count, lba, left;
+
+    if (ra->pos < end) {
+	lba = _cd_stream_locate(s, ra->pos, &left);
+	n = MIN(CHUNK_FRAMES, left);
+	while ((n > 0) &&
+	       (_cd_resample_room(ra->rs, n * CD_FRAME_SAMPLES) > nfree))
+	    n /= 2;
+	if ((n == 0) || ((n < MIN_CHUNK_FRAMES) && (n < left)))
+	    return 0;
+
+	if (cd_read_audio(s->dev, lba, n, ra->in) != 0) {
+	    fail(ra);
+	    return 0;
+	}
+	ra->pos += n;
+	count = _cd_resample(ra->rs, ra->in, n * CD_FRAME_SAMPLES, ra->out);
+    }
+    else if (!ra->flushed) {
+	if (_cd_resample_room(ra->rs, 0) > nfree)
+	    return 0;
+	count = _cd_resample_flush(ra->rs, ra->out);
+	ra->flushed = 1;
+    }
+    else
+	return 0;
+
+    idx = head % ra->capacity;
+    n1 = MIN(count, ra->capacity - idx);
+    memcpy(ra->ring + idx * ra->sample_bytes, ra->out, n1 * ra->sample_bytes);
+    memcpy(ra->ring, ra->out + n1 * ra->sample_bytes,
+	   (count - n1) * ra->sample_bytes);
+
+    return count;
+}
+
+
+static void *producer(void *arg)
+{
+    cd_stream *s = arg;
+    struct Readahead *ra = s->ra;
+    uint64_t head, tail;
+    int nfree, n, end;
+
+    for (;;) {
+	head = ra->head;
+	tail = __atomic_load_n(&ra->tail, __ATOMIC_ACQUIRE);
+	nfree = ra->capacity - (int)(head - tail);
+	end = __atomic_load_n(&s->length, __ATOMIC_ACQUIRE);
+
+	if ((ra->pos >= end) && (!ra->rs || ra->flushed) && !ra->eof)
+	    __atomic_store_n(&ra->eof, 1, __ATOMIC_RELEASE);
+
+	/* Something was queued after all.  It comes after a gap. */
+	if ((ra->pos < end) && ra->eof) {
+	    ra->flushed = 0;
+	    __atomic_store_n(&ra->eof, 0, __ATOMIC_RELEASE);
+	}
+
+	n = 0;
+	if (!ra->eof && !ra->error) {
+	    if (ra->rs)
+		n = fill_converted(s, ra, head, nfree, end);
+	    else
+		n = fill_direct(s, ra, head, nfree, end);
+	}
+
+	if (n == 0) {
+	    if (wait_quit(ra, FULL_SLEEP))
+		break;
+	    continue;
+	}
+
+	__atomic_store_n(&ra->head, head + n, __ATOMIC_RELEASE);
+
+	pthread_mutex_lock(&ra->lock);
+	n = ra->quit;
+	pthread_mutex_unlock(&ra->lock);
+	if (n)
+	    break;
+    }
+
+    return NULL;
+}
+
+
+/* free_readahead:
+ *  Free RA and its buffers, after the thread has gone.
+ */
+static void free_readahead(struct Readahead *ra)
+{
+    _cd_resampler_destroy(ra->rs);
+    free(ra->in);
+    free(ra->out);
+    free(ra->ring);
+    free(ra);
+}
+
+
+/* _cd_readahead_stop:
+ *  Stop the readahead thread of S, if any, and free its buffer.
+ */
+void _cd_readahead_stop(cd_stream *s)
+{
+    struct Readahead *ra = s->ra;
+
+    if (!ra)
+	return;
+
+    pthread_mutex_lock(&ra->lock);
+    ra->quit = 1;
+    pthread_cond_signal(&ra->cond);
+    pthread_mutex_unlock(&ra->lock);
+
+    pthread_join(ra->thread, NULL);
+    pthread_cond_destroy(&ra->cond);
+    pthread_mutex_destroy(&ra->lock);
+    free_readahead(ra);
+    s->ra = NULL;
+}
+
+
+/* _cd_readahead_tell:
+ *  Return the frame of the stream the consumer has got up to.
+ */
+int _cd_readahead_tell(cd_stream *s)
+{
+    struct Readahead *ra = s->ra;
+    uint64_t tail = __atomic_load_n(&ra->tail, __ATOMIC_RELAXED);
+
+    tail = tail * CD_SAMPLE_RATE / s->rate;
+    return ra->start + (int)(tail / CD_FRAME_SAMPLES);
+}
+
+
+/* cd_stream_readahead:
+ *  Start a thread keeping MSECS milliseconds of S buffered from the
+ *  current position, for cd_stream_pull.  Zero stops it again.  Return
+ *  zero on success.
+ */
+int cd_stream_readahead(cd_stream *s, int msecs)
+{
+    struct Readahead *ra;
+    int nframes, n;
+
+    if (s->ra) {
+	s->pos = _cd_readahead_tell(s);
+	_cd_readahead_stop(s);
+    }
+
+    if (msecs <= 0)
+	return 0;
+
+    ra = calloc(1, sizeof(struct Readahead));
+    if (!ra) {
+	_cd_copy_error();
+	return -1;
+    }
+
+    nframes = MAX((msecs * CD_FRAMES + 999) / 1000, 2 * MIN_CHUNK_FRAMES);
+    ra->capacity = nframes * CD_FRAME_SAMPLES;
+    ra->sample_bytes = _cd_resample_bytes(s->format);
+
+    if ((s->rate != CD_SAMPLE_RATE) || (s->format != CD_FORMAT_S16)) {
+	ra->rs = _cd_resampler_create(s->rate, s->format,
+				      CHUNK_FRAMES * CD_FRAME_SAMPLES);
+	if (!ra->rs) {
+	    free(ra);
+	    return -1;
+	}
+
+	n = MAX(_cd_resample_room(ra->rs, CHUNK_FRAMES * CD_FRAME_SAMPLES),
+		_cd_resample_room(ra->rs, 0));
+	ra->capacity = MAX(_cd_resample_room(ra->rs, ra->capacity), 2 * n);
+	ra->in = malloc(CHUNK_FRAMES * CD_FRAME_BYTES);
+	ra->out = malloc(n * ra->sample_bytes);
+    }
+
+    ra->ring = malloc(ra->capacity * ra->sample_bytes);
+    if (!ra->ring || (ra->rs && (!ra->in || !ra->out))) {
+	_cd_copy_error();
+	free_readahead(ra);
+	return -1;
+    }
+
+    ra->start = ra->pos = s->pos;
+    ra->msecs = msecs;
+    pthread_mutex_init(&ra->lock, NULL);
+    pthread_cond_init(&ra->cond, NULL);
+    s->ra = ra;
+
+    if (pthread_create(&ra->thread, NULL, producer, s) != 0) {
+	_cd_set_error(CDERR_NO_MEMORY, "Cannot create thread");
+	pthread_cond_destroy(&ra->cond);
+	pthread_mutex_destroy(&ra->lock);
+	free_readahead(ra);
+	s->ra = NULL;
+	return -1;
+    }
+
+    return 0;
+}
+
+
+/* _cd_readahead_restart:
+ *  Throw away what has been buffered and start again from s->pos.
+ */
+int _cd_readahead_restart(cd_stream *s)
+{
+    int msecs = s->ra->msecs;
+
+    _cd_readahead_stop(s);
+    return cd_stream_readahead(s, msecs);
+}
+
+
+/* cd_stream_buffered:
+ *  Return the number of samples cd_stream_pull could return right now.
+ */
+int cd_stream_buffered(cd_stream *s)
+{
+    struct Readahead *ra = s->ra;
+
+    if (!ra)
+	return 0;
+
+    return (int)(__atomic_load_n(&ra->head, __ATOMIC_ACQUIRE) - ra->tail);
+}
+
+
+/* cd_stream_set_format:
+ *  Make cd_stream_pull deliver samples at RATE in FORMAT.  Anything
+ *  already buffered is thrown away.  Return zero on success.
+ */
+int cd_stream_set_format(cd_stream *s, int rate, int format)
+{
+    if ((format != CD_FORMAT_S16) && (format != CD_FORMAT_F32)) {
+	_cd_set_error(CDERR_BAD_ARG, "Bad sample format");
+	return -1;
+    }
+
+    if (_cd_resample_check(rate) != 0)
+	return -1;
+
+    if (s->ra)
+	s->pos = _cd_readahead_tell(s);
+
+    s->rate = rate;
+    s->format = format;
+
+    if (s->ra)
+	return _cd_readahead_restart(s);
+
+    return 0;
+}
+
+
+/* pull:
+ *  The work of cd_stream_pull.
+ */
+static int pull(cd_stream *s, void *dst, int n)
+{
+    struct Readahead *ra = s->ra;
+    unsigned char *out = dst;
+    uint64_t head, tail;
+    int avail, idx, n1;
+
+    if (!ra) {
+	_cd_set_error(CDERR_BAD_ARG, "Readahead not started");
+	return -1;
+    }
+
+    if ((n <= 0) || (!dst))
+	return 0;
+
+    head = __atomic_load_n(&ra->head, __ATOMIC_ACQUIRE);
+    tail = ra->tail;
+    avail = (int)(head - tail);
+
+    if (avail == 0) {
+	if (__atomic_load_n(&ra->error, __ATOMIC_ACQUIRE)) {
+	    _cd_set_error(ra->error_code, ra->error_str);
+	    return -1;
+	}
+	if (__atomic_load_n(&ra->eof, __ATOMIC_ACQUIRE)) {
+	    /* Something may have been written just before eof was set. */
+	    if (__atomic_load_n(&ra->head, __ATOMIC_ACQUIRE) == head)
+		return -1;
+	}
+	return 0;
+    }
+
+    n = MIN(n, avail);
+    idx = tail % ra->capacity;
+    n1 = MIN(n, ra->capacity - idx);
+
+    memcpy(out, ra->ring + idx * ra->sample_bytes, n1 * ra->sample_bytes);
+    if (n > n1)
+	memcpy(out + n1 * ra->sample_bytes, ra->ring,
+	       (n - n1) * ra->sample_bytes);
+
+    __atomic_store_n(&ra->tail, tail + n, __ATOMIC_RELEASE);
+
+    _cd_apply_gain(s, dst, n, s->format);
+    return n;
+}
+
+
+/* cd_stream_pull:
+ *  Copy up to N samples (stereo pairs, in the format chosen with
+ *  cd_stream_set_format) of buffered audio to DST.
+ *  Return the number copied, which is less than N if the readahead
+ *  thread has fallen behind, or -1 once the stream has ended or failed
+ *  and everything buffered has been pulled.  Never blocks.
+ */
+int cd_stream_pull(cd_stream *s, void *dst, int n)
+{
+    uint64_t t = _cd_stats_start(s->dev);
+    int ret = pull(s, dst, n);
+
+    /* Running out at the end of the stream is not an error. */
+    _cd_stats_end(s->dev, STAT_STREAM_PULL, t,
+		  (ret < 0) && (!s->ra || s->ra->error));
+    return ret;
+}
@@ -0,0 +1,353 @@
+/* libcda; sample rate conversion for the Linux component.
+ *
+ * Streams can hand over audio at another rate and in floating point,
+ * converted in the readahead thread.  The rate is changed by a
+ * polyphase filter: the ratio is reduced to L/M, and for every output
+ * sample one of L sets of taps of a windowed sinc is run over the
+ * input.  44100Hz to 48000Hz is 160/147.
+ *
+ * The dot products are the expensive part, so they use SSE or AVX2
+ * where the CPU has them.
+ */
+
+#include <string.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <math.h>
+#include "cdaint.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define HAVE_X86_SIMD
+#endif
+
+
+/* Taps per phase when not reducing the rate; a multiple of 8. */
+#define TAPS		64
+
+/* Most phases (L) we are prepared to keep tables for. */
+#define MAX_PHASES	640
+
+/* Passband as a fraction of the lower Nyquist frequency, and the
+ * Kaiser window shape. */
+#define CUTOFF		0.91
+#define KAISER_BETA	8.0
+
+
+struct Resampler {
+    int L, M;
+    int format;
+    int taps;
+    float *coef;		/* L phases of TAPS, reversed */
+    float *buf[2];		/* input history, one per channel */
+    int size;			/* samples BUF can hold */
+    int len;			/* samples in BUF */
+    int pos, phase;		/* next output is at POS + PHASE/L */
+};
+
+
+typedef float (*DOT)(const float *a, const float *b, int n);
+
+
+static float dot_c(const float *a, const float *b, int n)
+{
+    float sum = 0;
+    int i;
+
+    for (i = 0; i < n; i++)
+	sum += a[i] * b[i];
+
+    return sum;
+}
+
+
+#ifdef HAVE_X86_SIMD
+
+__attribute__((target("sse")))
+static float dot_sse(const float *a, const float *b, int n)
+{
+    __m128 sum = _mm_setzero_ps();
+    float r[4];
+    int i;
+
+    for (i = 0; i < n; i += 4)
+	sum = _mm_add_ps(sum, _mm_mul_ps(_mm_loadu_ps(a + i),
+					 _mm_loadu_ps(b + i)));
+
+    _mm_storeu_ps(r, sum);
+    return (r[0] + r[1]) + (r[2] + r[3]);
+}
+
+
+__attribute__((target("avx2,fma")))
+static float dot_avx2(const float *a, const float *b, int n)
+{
+    __m256 sum = _mm256_setzero_ps();
+    __m128 s;
+    int i;
+
+    for (i = 0; i < n; i += 8)
+	sum = _mm256_fmadd_ps(_mm256_loadu_ps(a + i),
+			      _mm256_loadu_ps(b + i), sum);
+
+    s = _mm_add_ps(_mm256_castps256_ps128(sum),
+		   _mm256_extractf128_ps(sum, 1));
+    s = _mm_add_ps(s, _mm_movehl_ps(s, s));
+    s = _mm_add_ss(s, _mm_shuffle_ps(s, s, 1));
+    return _mm_cvtss_f32(s);
+}
+
+#endif
+
+
+static DOT dot;
+static pthread_once_t dot_once = PTHREAD_ONCE_INIT;
+
+
+static void choose_dot(void)
+{
+    dot = dot_c;
+
+#ifdef HAVE_X86_SIMD
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma"))
+	dot = dot_avx2;
+    else if (__builtin_cpu_supports("sse"))
+	dot = dot_sse;
+#endif
+}
+
+
+static int gcd(int a, int b)
+{
+    while (b) {
+	int t = a % b;
+	a = b;
+	b = t;
+    }
+    return a;
+}
+
+
+/* bessel_i0:
+ *  Modified Bessel function of the first kind, order zero.
+ */
+static double bessel_i0(double x)
+{
+    double sum = 1, term = 1;
+    int k;
+
+    for (k = 1; k < 50; k++) {
+	term *= (x / (2 * k)) * (x / (2 * k));
+	sum += term;
+	if (term < sum * 1e-12)
+	    break;
+    }
+
+    return sum;
+}
+
+
+/* make_coef:
+ *  Design the filter for RS and split it into phases.  Each phase is
+ *  scaled to unity gain, so there is no ripple at DC.
+ */
+static void make_coef(struct Resampler *rs)
+{
+    int L = rs->L, T = rs->taps, N = L * T;
+    double fc = CUTOFF * 0.5 / MAX(rs->L, rs->M);
+    double c = N / 2;	/* so some tap lands exactly on each sample */
+    double x, r, h, sum;
+    int p, t, n;
+
+    for (p = 0; p < L; p++) {
+	sum = 0;
+	for (t = 0; t < T; t++) {
+	    n = p + (T - 1 - t) * L;
+	    x = n - c;
+	    h = (x == 0) ? 1 : sin(2 * M_PI * fc * x) / (2 * M_PI * fc * x);
+	    r = x / (c + 1);
+	    h *= bessel_i0(KAISER_BETA * sqrt(1 - r * r)) / bessel_i0(KAISER_BETA);
+	    rs->coef[p * T + t] = h;
+	    sum += h;
+	}
+	for (t = 0; t < T; t++)
+	    rs->coef[p * T + t] /= sum;
+    }
+}
+
+
+/* _cd_resample_check:
+ *  Return zero if we can convert to RATE, else set cd_error.
+ */
+int _cd_resample_check(int rate)
+{
+    if ((rate < 8000) || (rate > 192000)) {
+	_cd_set_error(CDERR_BAD_ARG, "Bad sample rate");
+	return -1;
+    }
+
+    if (rate / gcd(rate, CD_SAMPLE_RATE) > MAX_PHASES) {
+	_cd_set_error(CDERR_UNSUPPORTED, "Unsupported sample rate");
+	return -1;
+    }
+
+    return 0;
+}
+
+
+/* _cd_resampler_create:
+ *  Create a resampler from CD audio to RATE and FORMAT, taking up to
+ *  MAX_IN samples at a time.  Return NULL on error.
+ */
+struct Resampler *_cd_resampler_create(int rate, int format, int max_in)
+{
+    struct Resampler *rs;
+    int g;
+
+    pthread_once(&dot_once, choose_dot);
+
+    if (_cd_resample_check(rate) != 0)
+	return NULL;
+
+    rs = calloc(1, sizeof(struct Resampler));
+    if (!rs) {
+	_cd_copy_error();
+	return NULL;
+    }
+
+    g = gcd(rate, CD_SAMPLE_RATE);
+    rs->L = rate / g;
+    rs->M = CD_SAMPLE_RATE / g;
+    rs->format = format;
+
+    /* Just converting the format. */
+    if (rs->L == rs->M)
+	return rs;
+
+    /* Going down, the filter must be longer to be as sharp. */
+    rs->taps = TAPS * ((rs->M + rs->L - 1) / rs->L);
+    rs->size = rs->taps + max_in;
+    rs->coef = malloc(rs->L * rs->taps * sizeof(float));
+    rs->buf[0] = calloc(rs->size, sizeof(float));
+    rs->buf[1] = calloc(rs->size, sizeof(float));
+    if (!rs->coef || !rs->buf[0] || !rs->buf[1]) {
+	_cd_copy_error();
+	_cd_resampler_destroy(rs);
+	return NULL;
+    }
+
+    make_coef(rs);
+
+    /* Start with silence before the first sample, so the first output
+     * sample is centred on it. */
+    rs->len = rs->taps / 2 - 1;
+    rs->pos = rs->len;
+    return rs;
+}
+
+
+/* _cd_resampler_destroy:
+ */
+void _cd_resampler_destroy(struct Resampler *rs)
+{
+    if (rs) {
+	free(rs->coef);
+	free(rs->buf[0]);
+	free(rs->buf[1]);
+	free(rs);
+    }
+}
+
+
+/* _cd_resample_room:
+ *  Return the most samples _cd_resample could produce from N input
+ *  samples, or from flushing if N is zero.
+ */
+int _cd_resample_room(struct Resampler *rs, int n)
+{
+    if (n == 0)
+	n = rs->taps / 2;
+
+    return (int)(((int64_t)n * rs->L + rs->M - 1) / rs->M) + 1;
+}
+
+
+/* _cd_resample_flush:
+ *  Write the output RS is holding back for want of input to OUT, as if
+ *  the input were followed by silence.  Return the number of samples.
+ */
+int _cd_resample_flush(struct Resampler *rs, void *out)
+{
+    if (rs->L == rs->M)
+	return 0;
+
+    return _cd_resample(rs, NULL, rs->taps / 2, out);
+}
+
+
+/* _cd_resample_bytes:
+ *  Return the size of an output sample (both channels).
+ */
+int _cd_resample_bytes(int format)
+{
+    return (format == CD_FORMAT_F32) ? 2 * sizeof(float) : 2 * sizeof(int16_t);
+}
+
+
+static void put(struct Resampler *rs, void *out, int i, float l, float r)
+{
+    if (rs->format == CD_FORMAT_F32) {
+	((float *)out)[2*i]   = l * (1.0f / 32768);
+	((float *)out)[2*i+1] = r * (1.0f / 32768);
+    }
+    else {
+	((int16_t *)out)[2*i]   = MID(-32768, (int)lrintf(l), 32767);
+	((int16_t *)out)[2*i+1] = MID(-32768, (int)lrintf(r), 32767);
+    }
+}
+
+
+/* _cd_resample:
+ *  Feed N stereo samples from IN to RS, or N samples of silence if IN
+ *  is NULL, and write the output to OUT.  Return the number of output
+ *  samples.
+ */
+int _cd_resample(struct Resampler *rs, const int16_t *in, int n, void *out)
+{
+    int half = rs->taps / 2;
+    int i, k, drop;
+
+    if (rs->L == rs->M) {
+	for (i = 0; i < n; i++)
+	    put(rs, out, i, in ? in[2*i] : 0, in ? in[2*i+1] : 0);
+	return n;
+    }
+
+    for (i = 0; i < n; i++) {
+	rs->buf[0][rs->len + i] = in ? in[2*i] : 0;
+	rs->buf[1][rs->len + i] = in ? in[2*i+1] : 0;
+    }
+    rs->len += n;
+
+    for (k = 0; rs->pos + half < rs->len; k++) {
+	const float *c = rs->coef + rs->phase * rs->taps;
+	int w = rs->pos - half + 1;
+
+	put(rs, out, k, dot(c, rs->buf[0] + w, rs->taps),
+			dot(c, rs->buf[1] + w, rs->taps));
+
+	rs->phase += rs->M;
+	rs->pos += rs->phase / rs->L;
+	rs->phase %= rs->L;
+    }
+
+    /* Keep only what the next output still needs. */
+    drop = MIN(rs->pos - half + 1, rs->len);
+    memmove(rs->buf[0], rs->buf[0] + drop, (rs->len - drop) * sizeof(float));
+    memmove(rs->buf[1], rs->buf[1] + drop, (rs->len - drop) * sizeof(float));
+    rs->len -= drop;
+    rs->pos -= drop;
+
+    return k;
+}
@@ -0,0 +1,375 @@
+/* libcda; ripping for the Linux component.
+ *
+ * Each drive being ripped has a reader, which reads the disc from start
+ * to finish, which is all a drive is good at, and hands each block (or
+ * whole track) it has read to a pool of workers to encode, write or
+ * whatever the callback does.  So the CPU work overlaps the reading,
+ * and a rip takes about as long as reading the disc.
+ *
+ * Several drives share one pool.  Only so many blocks may be waiting at
+ * once, which bounds memory if the workers fall behind, and each drive
+ * still reading gets an equal share of them.  A fast drive then can't
+ * crowd out a slow one, and when the CPU is the limit every drive slows
+ * down alike.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include "cdaint.h"
+
+
+/* The reader checks for an abort this often while reading a block. */
+#define RIP_READ_FRAMES		(75 * 10)
+
+/* Most whole tracks a drive may have in memory, however many workers
+ * there are: one being done and the next being read. */
+#define RIP_MAX_TRACKS		2
+
+
+/* What the drives share. */
+typedef struct {
+    struct Pool *pool;
+    int block_frames;		/* or zero for whole tracks */
+
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    int max_outstanding;	/* blocks waiting, for all drives */
+    int readers;		/* drives still reading */
+} Sched;
+
+
+/* One drive. */
+struct Rip {
+    Sched *sched;
+    cd_rip_drive *drive;
+    pthread_t thread;
+    int started;
+    uint64_t t0;		/* for stats.c */
+
+    int outstanding;		/* blocks handed over and not yet done */
+    int aborted;		/* a callback failed; atomic */
+
+    int failed;			/* the reader failed, with: */
+    int error_code;
+    char error[256];
+};
+
+
+typedef struct {
+    Job job;			/* first, so a Job is a Block */
+    struct Rip *rip;
+    cd_rip_block info;
+    cd_checksums sums;
+    unsigned char data[];
+} Block;
+
+
+static int aborted(struct Rip *r)
+{
+    return __atomic_load_n(&r->aborted, __ATOMIC_ACQUIRE);
+}
+
+
+static void set_failed(struct Rip *r, int code, const char *s)
+{
+    r->failed = 1;
+    r->error_code = code;
+    strncpy(r->error, s, sizeof r->error);
+    r->error[sizeof r->error - 1] = 0;
+}
+
+
+/* run_block:
+ *  Pass a block to the callback, on a worker.  Once one call for a drive
+ *  fails, the blocks still waiting from that drive are dropped.
+ */
+static void run_block(Job *job)
+{
+    Block *b = (Block *)job;
+    struct Rip *r = b->rip;
+    Sched *sc = r->sched;
+
+    if (!aborted(r) && (r->drive->func(&b->info, r->drive->arg) != 0))
+	__atomic_store_n(&r->aborted, 1, __ATOMIC_RELEASE);
+
+    free(b);
+
+    pthread_mutex_lock(&sc->lock);
+    r->outstanding--;
+    pthread_cond_broadcast(&sc->cond);
+    pthread_mutex_unlock(&sc->lock);
+}
+
+
+/* share:
+ *  Return how many blocks R may have waiting.  Call with the lock held.
+ */
+static int share(struct Rip *r)
+{
+    Sched *sc = r->sched;
+    int n = MAX(1, sc->max_outstanding / sc->readers);
+
+    /* Less than this are waiting when the next one is read. */
+    if (!sc->block_frames)
+	n = MIN(n, RIP_MAX_TRACKS);
+
+    return n;
+}
+
+
+/* wait_for_room:
+ *  Wait until R is within its share of the blocks that may be waiting.
+ */
+static void wait_for_room(struct Rip *r)
+{
+    Sched *sc = r->sched;
+
+    pthread_mutex_lock(&sc->lock);
+    while (r->outstanding >= share(r))
+	pthread_cond_wait(&sc->cond, &sc->lock);
+    pthread_mutex_unlock(&sc->lock);
+}
+
+
+/* read_block:
+ *  Read NFRAMES frames at LBA into BUF.  Return zero on success, or -1
+ *  on error or if the rip has been aborted.
+ */
+static int read_block(struct Rip *r, int lba, int nframes, unsigned char *buf)
+{
+    int n;
+
+    while (nframes > 0) {
+	if (aborted(r))
+	    return -1;
+
+	n = MIN(nframes, RIP_READ_FRAMES);
+	if (cd_read_audio(r->drive->dev, lba, n, buf) != 0)
+	    return -1;
+
+	lba += n;
+	nframes -= n;
+	buf += n * CD_FRAME_BYTES;
+    }
+
+    return 0;
+}
+
+
+/* rip_track:
+ *  Read TRACK, from START to END, and hand it to the pool in blocks.
+ *  Return zero on success.
+ */
+static int rip_track(struct Rip *r, int track, int start, int end)
+{
+    Sched *sc = r->sched;
+    cd_device *dev = r->drive->dev;
+    Block *b;
+    int lba, n;
+
+    for (lba = start; lba < end; lba += n) {
+	n = (sc->block_frames) ? MIN(sc->block_frames, end - lba) : end - lba;
+
+	wait_for_room(r);
+
+	b = malloc(sizeof(Block) + n * CD_FRAME_BYTES);
+	if (!b) {
+	    _cd_copy_error();
+	    return -1;
+	}
+
+	if (read_block(r, lba, n, b->data) != 0) {
+	    free(b);
+	    return -1;
+	}
+
+	b->job.run = run_block;
+	b->rip = r;
+	b->info.track = track;
+	b->info.frame = lba - start;
+	b->info.nframes = n;
+	b->info.last = (lba + n == end);
+	b->info.data = b->data;
+	b->info.sums = NULL;
+
+	/* The track was read in order on this thread, so its sums are
+	 * finished by now unless someone else read it at the same time. */
+	if (b->info.last && (cd_get_checksums(dev, track, &b->sums) == 1))
+	    b->info.sums = &b->sums;
+
+	pthread_mutex_lock(&sc->lock);
+	r->outstanding++;
+	pthread_mutex_unlock(&sc->lock);
+
+	_cd_pool_submit(sc->pool, &b->job);
+    }
+
+    return 0;
+}
+
+
+/* rip_tracks:
+ *  Read the audio tracks asked of R and hand them to the pool.  Return
+ *  zero on success, or -1 with cd_error set.
+ */
+static int rip_tracks(struct Rip *r)
+{
+    cd_rip_drive *d = r->drive;
+    int t, start, end;
+
+    if ((!d->dev) || (!d->func) || (d->first > d->last)) {
+	_cd_set_error(CDERR_BAD_ARG, "Bad argument");
+	return -1;
+    }
+
+    if ((_cd_track_bounds(d->dev, d->first, &start, &end) < 0) ||
+	(_cd_track_bounds(d->dev, d->last, &start, &end) < 0))
+	return -1;
+
+    for (t = d->first; (t <= d->last) && !aborted(r); t++) {
+	switch (_cd_track_bounds(d->dev, t, &start, &end)) {
+	    case -1:
+		return -1;
+	    case 0:
+		continue;
+	}
+
+	if (rip_track(r, t, start, end) != 0)
+	    return -1;
+    }
+
+    return 0;
+}
+
+
+/* reader:
+ *  Rip one drive, then give up its share to the others.
+ */
+static void *reader(void *arg)
+{
+    struct Rip *r = arg;
+    Sched *sc = r->sched;
+
+    if (rip_tracks(r) != 0)
+	set_failed(r, cd_errno, cd_error);
+
+    pthread_mutex_lock(&sc->lock);
+    sc->readers--;
+    pthread_cond_broadcast(&sc->cond);
+    pthread_mutex_unlock(&sc->lock);
+
+    return NULL;
+}
+
+
+/* cd_rip_drives:
+ *  Rip N drives at once, each as cd_rip would, with one reader each and
+ *  NTHREADS workers between them (or one per CPU, if zero).  Return zero
+ *  if every drive succeeded.
+ */
+int cd_rip_drives(cd_rip_drive *drives, int n, int block_frames, int nthreads)
+{
+    Sched sc;
+    struct Rip *rips;
+    int i, failed = -1;
+
+    if ((!drives) || (n <= 0) || (block_frames < 0)) {
+	_cd_set_error(CDERR_BAD_ARG, "Bad argument");
+	return -1;
+    }
+
+    rips = calloc(n, sizeof(struct Rip));
+    if (!rips) {
+	_cd_copy_error();
+	return -1;
+    }
+
+    sc.pool = _cd_pool_create(nthreads);
+    if (!sc.pool) {
+	free(rips);
+	return -1;
+    }
+
+    /* Two blocks per worker keeps them all busy while the readers get
+     * ahead; whole tracks are big, so only one each, and see share(). */
+    i = _cd_pool_threads(sc.pool);
+    sc.max_outstanding = (block_frames) ? 2 * i : i;
+    sc.block_frames = block_frames;
+    sc.readers = n;
+    pthread_mutex_init(&sc.lock, NULL);
+    pthread_cond_init(&sc.cond, NULL);
+
+    for (i = 0; i < n; i++) {
+	rips[i].sched = &sc;
+	rips[i].drive = &drives[i];
+	if (drives[i].dev)
+	    rips[i].t0 = _cd_stats_start(drives[i].dev);
+    }
+
+    /* The first drive is read on this thread. */
+    for (i = 1; i < n; i++) {
+	if (pthread_create(&rips[i].thread, NULL, reader, &rips[i]) == 0) {
+	    rips[i].started = 1;
+	    continue;
+	}
+
+	set_failed(&rips[i], CDERR_NO_MEMORY, "Cannot create thread");
+	pthread_mutex_lock(&sc.lock);
+	sc.readers--;
+	pthread_mutex_unlock(&sc.lock);
+    }
+
+    reader(&rips[0]);
+
+    for (i = 1; i < n; i++)
+	if (rips[i].started)
+	    pthread_join(rips[i].thread, NULL);
+
+    pthread_mutex_lock(&sc.lock);
+    for (i = 0; i < n; i++)
+	while (rips[i].outstanding > 0)
+	    pthread_cond_wait(&sc.cond, &sc.lock);
+    pthread_mutex_unlock(&sc.lock);
+
+    _cd_pool_destroy(sc.pool);
+    pthread_cond_destroy(&sc.cond);
+    pthread_mutex_destroy(&sc.lock);
+
+    for (i = 0; i < n; i++) {
+	if (aborted(&rips[i]))
+	    set_failed(&rips[i], CDERR_ABORTED, "Aborted by callback");
+
+	drives[i].result = (rips[i].failed) ? -1 : 0;
+	drives[i].error = (rips[i].failed) ? rips[i].error_code : CDERR_NONE;
+	if ((rips[i].failed) && (failed < 0))
+	    failed = i;
+	if (drives[i].dev)
+	    _cd_stats_end(drives[i].dev, STAT_RIP, rips[i].t0, rips[i].failed);
+    }
+
+    if (failed >= 0)
+	_cd_set_error(rips[failed].error_code, rips[failed].error);
+
+    free(rips);
+    return (failed >= 0) ? -1 : 0;
+}
+
+
+/* cd_rip:
+ *  Read the audio tracks from FIRST to LAST, passing each BLOCK_FRAMES
+ *  frames (or each whole track, if zero) to FUNC on one of NTHREADS
+ *  workers (or one per CPU, if zero).  Return zero on success.
+ */
+int cd_rip(cd_device *dev, int first, int last, int block_frames,
+	   int nthreads, cd_rip_func func, void *arg)
+{
+    cd_rip_drive d;
+
+    d.dev = dev;
+    d.first = first;
+    d.last = last;
+    d.func = func;
+    d.arg = arg;
+
+    return cd_rip_drives(&d, 1, block_frames, nthreads);
+}
@@ -0,0 +1,207 @@
+/* libcda; call statistics for the Linux component.
+ *
+ * Once turned on for a drive, every public function which may ask the
+ * drive something or wait for it, and every ioctl made to it, is
+ * counted, with its errors and how long it took.  Times
+ * go into buckets by powers of two microseconds, so a histogram costs
+ * the same as a counter.  Everything is updated and read with relaxed
+ * atomics and no lock, so reading the counts never waits for the
+ * drive; turned off, each call costs one load.
+ */
+
+#include <string.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <time.h>
+#include "cdaint.h"
+
+
+struct Stats {
+    cd_stat stat[STAT_COUNT];
+};
+
+
+/* In the order of the STAT_* numbers. */
+static const char *names[STAT_COUNT] = {
+    "cd_play",
+    "cd_play_range",
+    "cd_play_from",
+    "cd_current_track",
+    "cd_pause",
+    "cd_resume",
+    "cd_is_paused",
+    "cd_stop",
+    "cd_get_tracks",
+    "cd_is_audio",
+    "cd_get_volume",
+    "cd_set_volume",
+    "cd_eject",
+    "cd_close",
+    "cd_read_audio",
+    "cd_map_audio",
+    "cd_stream_read",
+    "cd_stream_pull",
+    "cd_get_position",
+    "cd_stream_open",
+    "cd_stream_seek",
+    "cd_stream_queue",
+    "cd_get_checksums",
+    "cd_get_disc_ids",
+    "cd_get_layout",
+    "cd_rip",
+    "CDROMREADTOCHDR",
+    "CDROMREADTOCENTRY",
+    "CDROM_MEDIA_CHANGED",
+    "CDROM_DRIVE_STATUS",
+    "CDROMREADAUDIO",
+    "CDROMPLAYMSF",
+    "CDROMPLAYTRKIND",
+    "CDROMPAUSE",
+    "CDROMRESUME",
+    "CDROMSTOP",
+    "CDROMEJECT",
+    "CDROMCLOSETRAY",
+    "CDROMSUBCHNL",
+    "CDROMVOLREAD",
+    "CDROMVOLCTRL",
+    "SG_IO"
+};
+
+
+static uint64_t get_nsecs(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+
+/* _cd_stats_start:
+ *  Return the time to pass to _cd_stats_end, or zero if statistics are
+ *  off for DEV.
+ */
+uint64_t _cd_stats_start(cd_device *dev)
+{
+    if (!__atomic_load_n(&dev->stats_on, __ATOMIC_ACQUIRE))
+	return 0;
+
+    return get_nsecs();
+}
+
+
+/* _cd_stats_end:
+ *  Count a call of WHAT (a STAT_* number) that began at T0 and failed
+ *  if FAILED is non-zero.  Leaves errno alone.
+ */
+void _cd_stats_end(cd_device *dev, int what, uint64_t t0, int failed)
+{
+    cd_stat *st;
+    unsigned long us, max;
+    int b;
+
+    if (!t0)
+	return;
+
+    st = &dev->stats->stat[what];
+    us = (get_nsecs() - t0) / 1000;
+    b = (us) ? MIN(CD_STAT_BUCKETS - 1, 64 - __builtin_clzll(us)) : 0;
+
+    __atomic_add_fetch(&st->calls, 1, __ATOMIC_RELAXED);
+    if (failed)
+	__atomic_add_fetch(&st->errors, 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&st->hist[b], 1, __ATOMIC_RELAXED);
+
+    max = __atomic_load_n(&st->max_us, __ATOMIC_RELAXED);
+    while ((us > max) &&
+	   !__atomic_compare_exchange_n(&st->max_us, &max, us, 1,
+					__ATOMIC_RELAXED, __ATOMIC_RELAXED))
+	;
+}
+
+
+/* _cd_stats_free:
+ */
+void _cd_stats_free(cd_device *dev)
+{
+    free(dev->stats);
+    dev->stats = NULL;
+}
+
+
+/* cd_enable_stats:
+ *  Start or stop counting calls on DEV.  The counts are kept while it
+ *  is off.  Return zero on success.
+ */
+int cd_enable_stats(cd_device *dev, int enable)
+{
+    int ret = 0;
+
+    pthread_mutex_lock(&dev->lock);
+
+    if ((enable) && (!dev->stats)) {
+	struct Stats *stats = calloc(1, sizeof(struct Stats));
+	if (stats)
+	    __atomic_store_n(&dev->stats, stats, __ATOMIC_RELEASE);
+	else {
+	    _cd_copy_error();
+	    ret = -1;
+	}
+    }
+
+    /* The counters are never freed while DEV is open, so a call that
+     * saw statistics on can always finish counting. */
+    if (ret == 0)
+	__atomic_store_n(&dev->stats_on, enable != 0, __ATOMIC_RELEASE);
+
+    pthread_mutex_unlock(&dev->lock);
+    return ret;
+}
+
+
+/* cd_get_stats:
+ *  Copy the counts for up to N functions and ioctls into OUT.  Return
+ *  how many there are altogether.
+ */
+int cd_get_stats(cd_device *dev, cd_stat *out, int n)
+{
+    struct Stats *stats = __atomic_load_n(&dev->stats, __ATOMIC_ACQUIRE);
+    cd_stat *st;
+    int i, b;
+
+    for (i = 0; i < MIN(n, STAT_COUNT); i++) {
+	memset(&out[i], 0, sizeof(cd_stat));
+	out[i].name = names[i];
+	if (!stats)
+	    continue;
+
+	st = &stats->stat[i];
+	out[i].calls = __atomic_load_n(&st->calls, __ATOMIC_RELAXED);
+	out[i].errors = __atomic_load_n(&st->errors, __ATOMIC_RELAXED);
+	out[i].max_us = __atomic_load_n(&st->max_us, __ATOMIC_RELAXED);
+	for (b = 0; b < CD_STAT_BUCKETS; b++)
+	    out[i].hist[b] = __atomic_load_n(&st->hist[b], __ATOMIC_RELAXED);
+    }
+
+    return STAT_COUNT;
+}
+
+
+/* cd_reset_stats:
+ *  Zero the counts for DEV.  Calls in progress may still be counted.
+ */
+void cd_reset_stats(cd_device *dev)
+{
+    struct Stats *stats = __atomic_load_n(&dev->stats, __ATOMIC_ACQUIRE);
+    cd_stat *st;
+    int i, b;
+
+    for (i = 0; (stats) && (i < STAT_COUNT); i++) {
+	st = &stats->stat[i];
+	__atomic_store_n(&st->calls, 0, __ATOMIC_RELAXED);
+	__atomic_store_n(&st->errors, 0, __ATOMIC_RELAXED);
+	__atomic_store_n(&st->max_us, 0, __ATOMIC_RELAXED);
+	for (b = 0; b < CD_STAT_BUCKETS; b++)
+	    __atomic_store_n(&st->hist[b], 0, __ATOMIC_RELAXED);
+    }
+}
@@ -0,0 +1,873 @@
+/*
+ * Tests for libcda (Linux).
+ *
+ * Builds disc images with known layouts and contents in a temporary
+ * directory and checks what libcda makes of them: the TOC, the audio,
+ * checksums, the cache, ripping, streams and their conversions.
+ * `make check' runs it; it prints what failed and exits non-zero if
+ * anything did.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <math.h>
+#include <unistd.h>
+#include <pthread.h>
+#include "libcda.h"
+
+
+static char dir[] = "/tmp/libcda-test-XXXXXX";
+static int failures;
+
+
+#define CHECK(cond)							\
+    do {								\
+	if (!(cond)) {							\
+	    printf("%s:%d: failed: %s\n", __FILE__, __LINE__, #cond);	\
+	    failures++;							\
+	}								\
+    } while (0)
+
+
+/* make_image:
+ *  Write NAME.cue and a matching (sparse) NAME.bin of NFRAMES frames.
+ *  Return the path of the cue sheet, which is static.
+ */
+static const char *make_image(const char *name, const char *cue, int nframes)
+{
+    static char path[256];
+    FILE *f;
+
+    snprintf(path, sizeof path, "%s/%s.bin", dir, name);
+    f = fopen(path, "w");
+    if (!f)
+	return NULL;
+    if (ftruncate(fileno(f), (off_t)nframes * CD_FRAME_BYTES) != 0) {
+	fclose(f);
+	return NULL;
+    }
+    fclose(f);
+
+    snprintf(path, sizeof path, "%s/%s.cue", dir, name);
+    f = fopen(path, "w");
+    if (!f)
+	return NULL;
+    fprintf(f, "FILE \"%s.bin\" BINARY\n%s", name, cue);
+    fclose(f);
+
+    return path;
+}
+
+
+/* fill_image:
+ *  Fill NAME.bin, of NFRAMES frames, with noise from SEED, or with the
+ *  sample DC in both channels if SEED is zero.  Return a copy of what
+ *  was written, to compare reads with, or NULL.
+ */
+static unsigned char *fill_image(const char *name, int nframes,
+				 unsigned int seed, int dc)
+{
+    char path[256];
+    unsigned char *data;
+    uint32_t x = seed;
+    size_t i, size = (size_t)nframes * CD_FRAME_BYTES;
+    FILE *f;
+
+    data = malloc(size);
+    if (!data)
+	return NULL;
+
+    for (i = 0; i < size; i += 2) {
+	if (seed) {
+	    x ^= x << 13;
+	    x ^= x >> 17;
+	    x ^= x << 5;
+	    data[i] = x & 0xff;
+	    data[i + 1] = (x >> 8) & 0xff;
+	}
+	else {
+	    data[i] = dc & 0xff;
+	    data[i + 1] = (dc >> 8) & 0xff;
+	}
+    }
+
+    snprintf(path, sizeof path, "%s/%s.bin", dir, name);
+    f = fopen(path, "w");
+    if ((!f) || (fwrite(data, 1, size, f) != size)) {
+	if (f)
+	    fclose(f);
+	free(data);
+	return NULL;
+    }
+    fclose(f);
+
+    return data;
+}
+
+
+/* reference_sums:
+ *  Work out the checksums of the NFRAMES frames at P one sample at a
+ *  time, as a check on the library's kernels.  FIRST and LAST say
+ *  whether AccurateRip should skip the start and end.
+ */
+static void reference_sums(const unsigned char *p, int nframes, int first,
+			   int last, cd_checksums *out)
+{
+    int n = nframes * CD_FRAME_SAMPLES, i, k;
+    uint32_t crc = 0xffffffff, lo = 0, hi = 0, s;
+    uint64_t x;
+
+    for (i = 0; i < nframes * CD_FRAME_BYTES; i++) {
+	crc ^= p[i];
+	for (k = 0; k < 8; k++)
+	    crc = (crc & 1) ? 0xedb88320 ^ (crc >> 1) : crc >> 1;
+    }
+
+    for (i = 0; i < n; i++) {
+	if ((first && (i < 5 * CD_FRAME_SAMPLES - 1)) ||
+	    (last && (i >= n - 5 * CD_FRAME_SAMPLES)))
+	    continue;
+	s = p[4*i] | (p[4*i+1] << 8) | (p[4*i+2] << 16) |
+	    ((uint32_t)p[4*i+3] << 24);
+	x = (uint64_t)s * (uint32_t)(i + 1);
+	lo += (uint32_t)x;
+	hi += (uint32_t)(x >> 32);
+    }
+
+    out->crc32 = crc ^ 0xffffffff;
+    out->accuraterip_v1 = lo;
+    out->accuraterip_v2 = (uint32_t)(lo + hi);
+}
+
+
+static int same_sums(const cd_checksums *a, const cd_checksums *b)
+{
+    return (a->crc32 == b->crc32) &&
+	   (a->accuraterip_v1 == b->accuraterip_v1) &&
+	   (a->accuraterip_v2 == b->accuraterip_v2);
+}
+
+
+/* test_enhanced_cd_ids:
+ *  Three audio tracks and a data track in a second session.  The IDs
+ *  were worked out separately: MusicBrainz ends the disc 11400 frames
+ *  before the data track, AccurateRip skips the data track's start but
+ *  counts it and the real leadout, and freedb counts everything.
+ */
+static void test_enhanced_cd_ids(void)
+{
+    static const char cue[] =
+	"  TRACK 01 AUDIO\n"
+	"    INDEX 01 00:00:00\n"
+	"  TRACK 02 AUDIO\n"
+	"    INDEX 01 04:26:50\n"
+	"  TRACK 03 AUDIO\n"
+	"    INDEX 01 10:00:00\n"
+	"  TRACK 04 MODE1/2352\n"
+	"    INDEX 01 15:52:00\n";
+    const char *path = make_image("enhanced", cue, 80000);
+    cd_device *dev;
+    cd_disc_ids ids;
+
+    CHECK(path != NULL);
+    if (!path)
+	return;
+
+    dev = cd_open(path);
+    CHECK(dev != NULL);
+    if (!dev)
+	return;
+
+    CHECK(cd_get_disc_ids(dev, &ids) == 0);
+    CHECK(strcmp(ids.freedb, "2c042a04") == 0);
+    CHECK(strcmp(ids.musicbrainz, "8Yfi98AOLgptBK4tg_UNBLywA6A-") == 0);
+    CHECK(ids.accuraterip_id1 == 0x00023668);
+    CHECK(ids.accuraterip_id2 == 0x0008c619);
+    CHECK(strcmp(ids.accuraterip, "003-00023668-0008c619-2c042a04") == 0);
+
+    cd_release(dev);
+}
+
+
+/* Where the tracks of the image open_noise makes start, and its end. */
+static const int noise_lba[] = { 0, 1000, 1777, 2980 };
+
+
+/* open_noise:
+ *  Make an image of three tracks of noise, of lengths which aren't
+ *  multiples of anything, and open it.  Its contents go in DATA.
+ */
+static cd_device *open_noise(unsigned char **data)
+{
+    static const char cue[] =
+	"  TRACK 01 AUDIO\n"
+	"    INDEX 01 00:00:00\n"
+	"  TRACK 02 AUDIO\n"
+	"    INDEX 01 00:13:25\n"
+	"  TRACK 03 AUDIO\n"
+	"    INDEX 01 00:23:52\n";
+    const char *path = make_image("noise", cue, noise_lba[3]);
+    cd_device *dev;
+
+    *data = (path) ? fill_image("noise", noise_lba[3], 12345, 0) : NULL;
+    if (!*data)
+	return NULL;
+
+    dev = cd_open(path);
+    if (!dev) {
+	free(*data);
+	*data = NULL;
+    }
+
+    return dev;
+}
+
+
+/* test_checksums:
+ *  Checksums must come out the same whichever kernels the CPU gets,
+ *  however the track is cut up when it is read, so compare them with
+ *  ones worked out a sample at a time.
+ */
+static void test_checksums(void)
+{
+    unsigned char *data, *buf;
+    cd_device *dev = open_noise(&data);
+    cd_checksums sums, ref;
+    cd_stream *s;
+    int t, lba, n;
+
+    CHECK(dev != NULL);
+    if (!dev)
+	return;
+
+    buf = malloc(noise_lba[3] * CD_FRAME_BYTES);
+    CHECK(buf != NULL);
+    if (!buf)
+	goto done;
+
+    /* Track 1 in one go. */
+    CHECK(cd_get_checksums(dev, 1, &sums) == 0);
+    CHECK(cd_read_audio(dev, 0, noise_lba[1], buf) == 0);
+    CHECK(memcmp(buf, data, noise_lba[1] * CD_FRAME_BYTES) == 0);
+
+    /* Track 2 with a frame missed, then again in pieces of every size. */
+    n = noise_lba[2] - noise_lba[1];
+    CHECK(cd_read_audio(dev, noise_lba[1], 10, buf) == 0);
+    CHECK(cd_read_audio(dev, noise_lba[1] + 11, n - 11, buf) == 0);
+    CHECK(cd_get_checksums(dev, 2, &sums) == 0);
+    for (lba = noise_lba[1], n = 1; lba < noise_lba[2]; lba += n, n++) {
+	n = (n < noise_lba[2] - lba) ? n : noise_lba[2] - lba;
+	CHECK(cd_read_audio(dev, lba, n, buf) == 0);
+    }
+
+    /* Track 3 through a stream. */
+    s = cd_stream_open(dev, 3, 3);
+    CHECK(s != NULL);
+    if (s) {
+	while ((n = cd_stream_read(s, buf, 7)) > 0)
+	    ;
+	CHECK(n == 0);
+	cd_stream_close(s);
+    }
+
+    for (t = 1; t <= 3; t++) {
+	reference_sums(data + noise_lba[t - 1] * CD_FRAME_BYTES,
+		       noise_lba[t] - noise_lba[t - 1], t == 1, t == 3, &ref);
+	CHECK(cd_get_checksums(dev, t, &sums) == 1);
+	CHECK(same_sums(&sums, &ref));
+    }
+
+    /* Reading the first frame again starts over. */
+    CHECK(cd_read_audio(dev, noise_lba[2], 1, buf) == 0);
+    CHECK(cd_get_checksums(dev, 3, &sums) == 0);
+
+  done:
+
+    free(buf);
+    free(data);
+    cd_release(dev);
+}
+
+
+/* test_cue_sheet:
+ *  INDEX 00, PREGAP, FLAGS and a second, big-endian, file: check the
+ *  layout, what is read where, and what cd_map_audio will map.
+ */
+static void test_cue_sheet(void)
+{
+    static const char cue[] =
+	"  TRACK 01 AUDIO\n"
+	"    INDEX 01 00:00:00\n"
+	"  TRACK 02 AUDIO\n"
+	"    FLAGS PRE DCP\n"
+	"    INDEX 00 00:10:00\n"
+	"    INDEX 01 00:12:00\n"
+	"  TRACK 03 AUDIO\n"
+	"    PREGAP 00:02:00\n"
+	"    INDEX 01 00:20:00\n"
+	"FILE \"motorola.bin\" MOTOROLA\n"
+	"  TRACK 04 AUDIO\n"
+	"    INDEX 01 00:00:00\n";
+    static const int lba[] = { 0, 900, 1650, 2150, 2450 };
+    unsigned char *data = NULL, *swapped = NULL;
+    unsigned char buf[CD_FRAME_BYTES], zero[CD_FRAME_BYTES];
+    const unsigned char *mapped;
+    const char *path;
+    cd_device *dev = NULL;
+    cd_layout layout;
+    int t, i;
+
+    if (make_image("motorola", "", 300))
+	swapped = fill_image("motorola", 300, 999, 0);
+    path = make_image("cue", cue, 2000);
+    if (path)
+	data = fill_image("cue", 2000, 777, 0);
+    if (data)
+	dev = cd_open(path);
+
+    CHECK(dev && data && swapped);
+    if (!dev || !data || !swapped)
+	goto done;
+
+    CHECK(cd_get_layout_h(dev, &layout) == 0);
+    CHECK((layout.first == 1) && (layout.last == 4));
+    CHECK(layout.leadout == lba[4]);
+    CHECK(!layout.unverified);
+    for (t = 1; t <= 4; t++) {
+	CHECK(layout.track[t].lba == lba[t - 1]);
+	CHECK(layout.track[t].length == lba[t] - lba[t - 1]);
+	CHECK(layout.track[t].audio);
+	CHECK(layout.track[t].preemphasis == (t == 2));
+	CHECK(layout.track[t].copy == (t == 2));
+    }
+
+    /* Track 2's INDEX 00 is in the file, so track 1 runs on into it. */
+    CHECK(cd_read_audio(dev, 749, 1, buf) == 0);
+    CHECK(memcmp(buf, data + 749 * CD_FRAME_BYTES, CD_FRAME_BYTES) == 0);
+    CHECK(cd_read_audio(dev, 900, 1, buf) == 0);
+    CHECK(memcmp(buf, data + 900 * CD_FRAME_BYTES, CD_FRAME_BYTES) == 0);
+
+    /* The PREGAP is silence that isn't in the file. */
+    memset(zero, 0, sizeof zero);
+    CHECK(cd_read_audio(dev, 1500, 1, buf) == 0);
+    CHECK(memcmp(buf, zero, CD_FRAME_BYTES) == 0);
+    CHECK(cd_read_audio(dev, 1649, 1, buf) == 0);
+    CHECK(memcmp(buf, zero, CD_FRAME_BYTES) == 0);
+    CHECK(cd_read_audio(dev, 1650, 1, buf) == 0);
+    CHECK(memcmp(buf, data + 1500 * CD_FRAME_BYTES, CD_FRAME_BYTES) == 0);
+
+    /* MOTOROLA files have their bytes swapped. */
+    CHECK(cd_read_audio(dev, 2150, 1, buf) == 0);
+    for (i = 0; i < CD_FRAME_BYTES; i += 2)
+	if ((buf[i] != swapped[i + 1]) || (buf[i + 1] != swapped[i]))
+	    break;
+    CHECK(i == CD_FRAME_BYTES);
+
+    /* Only runs of one little-endian file can be mapped. */
+    mapped = cd_map_audio(dev, 900, 600);
+    CHECK(mapped != NULL);
+    if (mapped)
+	CHECK(!memcmp(mapped, data + 900 * CD_FRAME_BYTES,
+		      600 * CD_FRAME_BYTES));
+    CHECK(cd_map_audio(dev, 1400, 200) == NULL);
+    CHECK(cd_map_audio(dev, 2150, 1) == NULL);
+    CHECK(cd_map_audio(dev, 2400, 100) == NULL);
+
+  done:
+
+    free(data);
+    free(swapped);
+    if (dev)
+	cd_release(dev);
+}
+
+
+/* test_cache:
+ *  Checksums kept in the cache come back for a disc opened later, even
+ *  after a writer died half way through a record.
+ */
+static void test_cache(void)
+{
+    unsigned char *data, *buf = malloc(noise_lba[3] * CD_FRAME_BYTES);
+    char cache[256];
+    cd_device *dev = open_noise(&data);
+    cd_checksums sums, ref;
+    cd_disc_ids ids;
+    FILE *f;
+    int t;
+
+    snprintf(cache, sizeof cache, "%s/cache", dir);
+
+    CHECK(dev && buf);
+    if (!dev || !buf)
+	goto done;
+
+    CHECK(cd_set_cache(dev, cache) == 0);
+    CHECK(cd_read_audio(dev, 0, noise_lba[1], buf) == 0);
+    CHECK(cd_get_checksums(dev, 1, &sums) == 1);
+    cd_release(dev);
+
+    f = fopen(cache, "a");
+    CHECK(f != NULL);
+    if (f) {
+	fputs("torn", f);
+	fclose(f);
+    }
+
+    /* The image gives its whole TOC, so what comes back is verified. */
+    free(data);
+    dev = open_noise(&data);
+    CHECK(dev != NULL);
+    if (!dev)
+	goto done;
+    CHECK(cd_set_cache(dev, cache) == 0);
+    CHECK(cd_get_disc_ids(dev, &ids) == 0);
+    CHECK(!ids.unverified);
+    CHECK(cd_get_checksums(dev, 1, &sums) == 1);
+    CHECK(cd_get_checksums(dev, 2, &sums) == 0);
+    CHECK(cd_read_audio(dev, noise_lba[1], noise_lba[2] - noise_lba[1],
+			buf) == 0);
+    cd_release(dev);
+
+    /* Track 2 was written after the torn record, so that must be gone. */
+    free(data);
+    dev = open_noise(&data);
+    CHECK(dev != NULL);
+    if (!dev)
+	goto done;
+    CHECK(cd_set_cache(dev, cache) == 0);
+    for (t = 1; t <= 2; t++) {
+	reference_sums(data + noise_lba[t - 1] * CD_FRAME_BYTES,
+		       noise_lba[t] - noise_lba[t - 1], t == 1, 0, &ref);
+	CHECK(cd_get_checksums(dev, t, &sums) == 1);
+	CHECK(same_sums(&sums, &ref));
+    }
+    CHECK(cd_get_checksums(dev, 3, &sums) == 0);
+
+  done:
+
+    free(buf);
+    free(data);
+    if (dev)
+	cd_release(dev);
+}
+
+
+/* What test_rip's callback has seen. */
+typedef struct {
+    pthread_mutex_t lock;
+    const unsigned char *data;
+    unsigned char seen[3000];	/* times each frame was passed on */
+    int calls, lasts, sums, bad;
+    int next;			/* where the next block should start */
+    int in_order;		/* check blocks come in order */
+    int abort_at;		/* fail this call, if positive */
+} RipState;
+
+
+static int rip_func(const cd_rip_block *b, void *arg)
+{
+    RipState *st = arg;
+    int lba = noise_lba[b->track - 1] + b->frame, i, ret = 0;
+    cd_checksums ref;
+
+    pthread_mutex_lock(&st->lock);
+
+    if (memcmp(b->data, st->data + lba * CD_FRAME_BYTES,
+	       b->nframes * CD_FRAME_BYTES) != 0)
+	st->bad++;
+    for (i = 0; i < b->nframes; i++)
+	st->seen[lba + i]++;
+
+    if (st->in_order) {
+	if (lba != st->next)
+	    st->bad++;
+	st->next = lba + b->nframes;
+    }
+
+    if (b->last) {
+	st->lasts++;
+	if (lba + b->nframes != noise_lba[b->track])
+	    st->bad++;
+	if (b->sums) {
+	    reference_sums(st->data + noise_lba[b->track - 1] * CD_FRAME_BYTES,
+			   noise_lba[b->track] - noise_lba[b->track - 1],
+			   b->track == 1, b->track == 3, &ref);
+	    if (same_sums(b->sums, &ref))
+		st->sums++;
+	}
+    }
+
+    if (++st->calls == st->abort_at)
+	ret = 1;
+
+    pthread_mutex_unlock(&st->lock);
+    return ret;
+}
+
+
+/* rip:
+ *  Rip the noise image into ST with BLOCK_FRAMES and NTHREADS, and
+ *  return what cd_rip did.
+ */
+static int rip(RipState *st, int block_frames, int nthreads, int in_order,
+	       int abort_at)
+{
+    cd_device *dev;
+    unsigned char *data;
+    int ret = -2;
+
+    memset(st, 0, sizeof(RipState));
+    pthread_mutex_init(&st->lock, NULL);
+    st->in_order = in_order;
+    st->abort_at = abort_at;
+
+    dev = open_noise(&data);
+    CHECK(dev != NULL);
+    if (dev) {
+	st->data = data;
+	ret = cd_rip(dev, 1, 3, block_frames, nthreads, rip_func, st);
+	if (ret != 0)
+	    ret = -cd_errno;
+	cd_release(dev);
+	free(data);
+    }
+
+    pthread_mutex_destroy(&st->lock);
+    return ret;
+}
+
+
+static int all_seen_once(RipState *st)
+{
+    int i;
+
+    for (i = 0; i < noise_lba[3]; i++)
+	if (st->seen[i] != 1)
+	    return 0;
+
+    return 1;
+}
+
+
+/* test_rip:
+ *  Every frame reaches the callback once, in order on one worker,
+ *  with the checksums on each track's last block, and a callback
+ *  failing stops the rip.
+ */
+static void test_rip(void)
+{
+    static RipState st;
+
+    CHECK(rip(&st, 100, 4, 0, 0) == 0);
+    CHECK(all_seen_once(&st) && !st.bad);
+    CHECK((st.lasts == 3) && (st.sums == 3));
+    CHECK(st.calls == 10 + 8 + 13);
+
+    CHECK(rip(&st, 64, 1, 1, 0) == 0);
+    CHECK(all_seen_once(&st) && !st.bad);
+
+    CHECK(rip(&st, 0, 4, 0, 0) == 0);
+    CHECK(all_seen_once(&st) && !st.bad);
+    CHECK((st.calls == 3) && (st.sums == 3));
+
+    CHECK(rip(&st, 10, 2, 0, 2) == -CDERR_ABORTED);
+    CHECK((st.calls >= 2) && (st.calls < 10));
+}
+
+
+/* test_gapless:
+ *  A stream with a track queued on it runs from one into the other,
+ *  read directly or through readahead.
+ */
+static void test_gapless(void)
+{
+    unsigned char *data, *buf = NULL, *expect = NULL;
+    int len1 = noise_lba[1], len3 = noise_lba[3] - noise_lba[2];
+    cd_device *dev = open_noise(&data);
+    cd_stream *s;
+    int n, got, tries;
+
+    CHECK(dev != NULL);
+    if (!dev)
+	return;
+
+    buf = malloc((len1 + len3) * CD_FRAME_BYTES);
+    expect = malloc((len1 + len3) * CD_FRAME_BYTES);
+    CHECK(buf && expect);
+    if (!buf || !expect)
+	goto done;
+    memcpy(expect, data, len1 * CD_FRAME_BYTES);
+    memcpy(expect + len1 * CD_FRAME_BYTES,
+	   data + noise_lba[2] * CD_FRAME_BYTES, len3 * CD_FRAME_BYTES);
+
+    s = cd_stream_open(dev, 1, 1);
+    CHECK(s != NULL);
+    if (s) {
+	CHECK(cd_stream_queue(s, 3, 3) == 0);
+	CHECK(cd_stream_length(s) == len1 + len3);
+	got = 0;
+	while ((n = cd_stream_read(s, buf + got * CD_FRAME_BYTES, 99)) > 0) {
+	    got += n;
+	    if (got == 990)
+		CHECK(cd_stream_track(s) == 1);
+	    if (got == 1089)
+		CHECK(cd_stream_track(s) == 3);
+	}
+	CHECK(got == len1 + len3);
+	CHECK(cd_stream_track(s) == 0);
+	CHECK(memcmp(buf, expect, got * CD_FRAME_BYTES) == 0);
+	cd_stream_close(s);
+    }
+
+    s = cd_stream_open(dev, 1, 1);
+    CHECK(s != NULL);
+    if (s) {
+	CHECK(cd_stream_readahead(s, 500) == 0);
+	CHECK(cd_stream_queue(s, 3, 3) == 0);
+	memset(buf, 0, (len1 + len3) * CD_FRAME_BYTES);
+	for (got = 0, tries = 0; tries < 10000; tries++) {
+	    n = cd_stream_pull(s, buf + got * 4, 1000);
+	    if (n < 0)
+		break;
+	    got += n;
+	    if (n == 0)
+		usleep(1000);
+	}
+	CHECK(got == (len1 + len3) * CD_FRAME_SAMPLES);
+	CHECK(memcmp(buf, expect, (len1 + len3) * CD_FRAME_BYTES) == 0);
+	cd_stream_close(s);
+    }
+
+  done:
+
+    free(buf);
+    free(expect);
+    free(data);
+    cd_release(dev);
+}
+
+
+/* open_dc:
+ *  Open an image of one track of NFRAMES frames of the sample DC.
+ */
+static cd_device *open_dc(int nframes, int dc)
+{
+    static const char cue[] =
+	"  TRACK 01 AUDIO\n"
+	"    INDEX 01 00:00:00\n";
+    const char *path = make_image("dc", cue, nframes);
+    unsigned char *data = (path) ? fill_image("dc", nframes, 0, dc) : NULL;
+
+    if (!data)
+	return NULL;
+
+    free(data);
+    return cd_open(path);
+}
+
+
+/* pull_all:
+ *  Pull everything S has to give into BUF, of SIZE bytes, in samples
+ *  of BYTES bytes.  Return how many samples there were.
+ */
+static int pull_all(cd_stream *s, void *buf, int size, int bytes)
+{
+    unsigned char *p = buf;
+    int n, got = 0, tries;
+
+    for (tries = 0; (tries < 10000) && (got < size / bytes); tries++) {
+	n = cd_stream_pull(s, p + got * bytes, size / bytes - got);
+	if (n < 0)
+	    break;
+	got += n;
+	if (n == 0)
+	    usleep(1000);
+    }
+
+    return got;
+}
+
+
+/* test_formats:
+ *  Streams converted to floats, and to other rates, keep a steady
+ *  level and come out the right length.
+ */
+static void test_formats(void)
+{
+    static const struct { int rate, format; } tests[] = {
+	{ 44100, CD_FORMAT_F32 },
+	{ 22050, CD_FORMAT_F32 },
+	{ 48000, CD_FORMAT_S16 },
+	{ 8000, CD_FORMAT_S16 },
+	{ 0, 0 }
+    };
+    const int nframes = 150, in = nframes * CD_FRAME_SAMPLES;
+    cd_device *dev = open_dc(nframes, 4096);
+    cd_stream *s;
+    float *buf;
+    int16_t *buf16;
+    int i, j, n, expect, bad;
+
+    buf = malloc(3 * in * 2 * sizeof(float));
+    CHECK(dev && buf);
+    if (!dev || !buf)
+	goto done;
+    buf16 = (int16_t *)buf;
+
+    for (i = 0; tests[i].rate; i++) {
+	s = cd_stream_open(dev, 1, 1);
+	CHECK(s != NULL);
+	if (!s)
+	    continue;
+
+	CHECK(cd_stream_set_format(s, 1000, tests[i].format) == -1);
+	CHECK(cd_stream_set_format(s, tests[i].rate, tests[i].format) == 0);
+	CHECK(cd_stream_readahead(s, 200) == 0);
+	n = pull_all(s, buf, 3 * in * 2 * sizeof(float),
+		     (tests[i].format == CD_FORMAT_F32) ? 8 : 4);
+	cd_stream_close(s);
+
+	/* The right number, give or take rounding. */
+	expect = (int)((double)in * tests[i].rate / CD_SAMPLE_RATE);
+	CHECK(abs(n - expect) <= 1);
+
+	/* Away from the ends, the level is what went in. */
+	for (j = n / 4, bad = 0; j < n * 3 / 4; j++) {
+	    if (tests[i].format == CD_FORMAT_F32)
+		bad += (fabs(buf[2*j] - 0.125) > 0.001) ||
+		       (fabs(buf[2*j+1] - 0.125) > 0.001);
+	    else
+		bad += (abs(buf16[2*j] - 4096) > 4) ||
+		       (abs(buf16[2*j+1] - 4096) > 4);
+	}
+	CHECK(bad == 0);
+    }
+
+  done:
+
+    free(buf);
+    if (dev)
+	cd_release(dev);
+}
+
+
+/* test_gain:
+ *  A change of volume is ramped in over a frame, without overshoot,
+ *  and then holds.
+ */
+static void test_gain(void)
+{
+    int16_t buf[2 * CD_FRAME_SAMPLES * 2];
+    const int mid = 2 * CD_FRAME_SAMPLES, end = 4 * CD_FRAME_SAMPLES;
+    cd_device *dev = open_dc(20, 4096);
+    cd_stream *s = (dev) ? cd_stream_open(dev, 1, 1) : NULL;
+    int i, bad;
+
+    CHECK(s != NULL);
+    if (!s)
+	goto done;
+
+    CHECK(cd_stream_read(s, buf, 2) == 2);
+    CHECK((buf[0] == 4096) && (buf[end - 1] == 4096));
+
+    /* (4096 * gain for 128) >> 14, where full volume is 1 << 14. */
+    cd_set_volume_h(dev, 128, 0);
+    CHECK(cd_stream_read(s, buf, 2) == 2);
+    for (i = 1, bad = 0; i < end / 2; i++)
+	bad += (buf[2*i] > buf[2*i-2]) || (buf[2*i] < 2056) ||
+	       (buf[2*i+1] > buf[2*i-1]) || (buf[2*i+1] < 0);
+    CHECK(bad == 0);
+    CHECK(buf[0] < 4096);
+    CHECK((buf[mid] == 2056) && (buf[mid + 1] == 0));
+    CHECK((buf[end - 2] == 2056) && (buf[end - 1] == 0));
+
+    cd_set_volume_h(dev, 255, 255);
+    CHECK(cd_stream_read(s, buf, 2) == 2);
+    CHECK((buf[mid] == 4096) && (buf[mid + 1] == 4096));
+
+  done:
+
+    if (s)
+	cd_stream_close(s);
+    if (dev)
+	cd_release(dev);
+}
+
+
+/* test_jitter:
+ *  With jitter correction on, a drive which reads where it is asked
+ *  gives the same audio, and nothing is shifted or read again.
+ */
+static void test_jitter(void)
+{
+    unsigned char *data, *buf = malloc(noise_lba[3] * CD_FRAME_BYTES);
+    cd_device *dev = open_noise(&data);
+    cd_stream *s = NULL;
+    int n, got = 0, shifted, rereads, failed;
+
+    CHECK(dev && buf);
+    if (!dev || !buf)
+	goto done;
+
+    CHECK(cd_set_jitter_correction(dev, 1) == 0);
+    s = cd_stream_open(dev, 1, 3);
+    CHECK(s != NULL);
+    if (!s)
+	goto done;
+
+    while ((n = cd_stream_read(s, buf + got * CD_FRAME_BYTES, 50)) > 0)
+	got += n;
+    CHECK(got == noise_lba[3]);
+    CHECK(memcmp(buf, data, noise_lba[3] * CD_FRAME_BYTES) == 0);
+
+    cd_get_jitter_stats(dev, &shifted, &rereads, &failed);
+    CHECK((shifted == 0) && (rereads == 0) && (failed == 0));
+
+  done:
+
+    if (s)
+	cd_stream_close(s);
+    free(buf);
+    free(data);
+    if (dev)
+	cd_release(dev);
+}
+
+
+int main(void)
+{
+    char cmd[64];
+
+    if (!mkdtemp(dir)) {
+	perror("test: mkdtemp");
+	return 1;
+    }
+
+    /* The tests make their own. */
+    unsetenv("CDAUDIO_CACHE");
+
+    test_enhanced_cd_ids();
+    test_checksums();
+    test_cue_sheet();
+    test_cache();
+    test_rip();
+    test_gapless();
+    test_formats();
+    test_gain();
+    test_jitter();
+
+    snprintf(cmd, sizeof cmd, "rm -rf %s", dir);
+    if (system(cmd) != 0)
+	printf("test: couldn't remove %s\n", dir);
+
+    if (failures) {
+	printf("%d failed\n", failures);
+	return 1;
+    }
+
+    printf("all passed\n");
+    return 0;
+}
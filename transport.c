@@ -0,0 +1,98 @@
+/* libcda; emulated audio transport for the Linux component.
+ *
+ * Drivers without a real drive behind them pretend to play with this:
+ * the position is worked out from when play started, at 75 frames per
+ * second.  Nothing is heard.
+ */
+
+#include <time.h>
+#include "cdaint.h"
+
+
+static double get_secs(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+
+/* position:
+ *  Bring the play position of TP up to date and return it.
+ */
+static int position(Transport *tp)
+{
+    int pos;
+
+    if (tp->audiostatus != CDROM_AUDIO_PLAY)
+	return tp->lba;
+
+    pos = tp->lba + (int)((get_secs() - tp->time) * CD_FRAMES);
+    if (pos >= tp->end) {
+	tp->audiostatus = CDROM_AUDIO_COMPLETED;
+	tp->lba = tp->end;
+	return tp->end;
+    }
+
+    return pos;
+}
+
+
+void _cd_transport_play(Transport *tp, int lba0, int lba1)
+{
+    tp->lba = lba0;
+    tp->end = lba1;
+    tp->time = get_secs();
+    tp->audiostatus = CDROM_AUDIO_PLAY;
+}
+
+
+void _cd_transport_pause(Transport *tp)
+{
+    if (tp->audiostatus == CDROM_AUDIO_PLAY) {
+	tp->lba = position(tp);
+	if (tp->audiostatus == CDROM_AUDIO_PLAY)
+	    tp->audiostatus = CDROM_AUDIO_PAUSED;
+    }
+}
+
+
+void _cd_transport_resume(Transport *tp)
+{
+    if (tp->audiostatus == CDROM_AUDIO_PAUSED) {
+	tp->time = get_secs();
+	tp->audiostatus = CDROM_AUDIO_PLAY;
+    }
+}
+
+
+void _cd_transport_stop(Transport *tp)
+{
+    tp->audiostatus = CDROM_AUDIO_NO_STATUS;
+}
+
+
+/* _cd_transport_subchnl:
+ *  Report the state of TP like the Q sub-channel of a drive would,
+ *  using the TOC of DEV.
+ */
+void _cd_transport_subchnl(cd_device *dev, Transport *tp, Subchnl *s)
+{
+    int pos = position(tp);
+    int t;
+
+    s->audiostatus = tp->audiostatus;
+
+    /* Like a drive, say COMPLETED once, then nothing. */
+    if (tp->audiostatus == CDROM_AUDIO_COMPLETED)
+	tp->audiostatus = CDROM_AUDIO_NO_STATUS;
+
+    for (t = dev->last_track;
+	 (t > dev->first_track) && (dev->tracks[t].lba > pos); t--)
+	;
+
+    s->track = t;
+    s->abs_lba = pos;
+    s->rel_lba = pos - dev->tracks[t].lba;
+}